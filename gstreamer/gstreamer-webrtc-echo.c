@@ -34,11 +34,15 @@
 #include <event2/event.h>
 #include <event2/http.h>
 #include <event2/http_struct.h>
+#include <event2/thread.h>
 #include <gst/gst.h>
 #include <gst/webrtc/webrtc.h>
 #include <gst/webrtc/dtlstransport.h>
+#include <gst/video/video.h>
 
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define HTTP_SERVER_ADDRESS "0.0.0.0"
@@ -46,18 +50,93 @@
 #define HTTP_OFFER_URL "/offer"
 #define RTP_CAPS_VP8 "application/x-rtp,media=video,encoding-name=VP8,payload=96"
 //#define RTP_CAPS_H264 "application/x-rtp,media=video,encoding-name=H264,payload=104"
-
+#define DEFAULT_WEBRTC_POOL_SIZE 4
+#define ANSWER_TIMEOUT_SECONDS 10
+
+enum log_level {
+  LOG_DEBUG,
+  LOG_INFO,
+  LOG_WARNING,
+  LOG_ERROR,
+  LOG_NONE
+};
+
+/* Log lines are formatted on the calling thread and written out in batches by
+ * log_thread, so the HTTP and GStreamer threads never wait on the console. Until
+ * the thread is started, lines are written directly. */
+static gint log_level = LOG_INFO;
+static gboolean log_sdp = FALSE;
+static GAsyncQueue* log_queue = NULL;
+static GThread* log_thread = NULL;
+static gchar log_stop_marker[] = "";
+
+/* Pipelines that have already been parsed and set to playing, ready for the next offer.
+ * A pool size of 0 disables the pool and a pipeline is created for each offer. */
+static GAsyncQueue* webrtc_pool = NULL;
+static gint webrtc_pool_size = DEFAULT_WEBRTC_POOL_SIZE;
+static gint webrtc_pool_refill_scheduled = 0;
+
+/* With a shared encoder a single test pattern is encoded once in shared_pipeline and
+ * every webrtcbin is attached to shared_tee as a new branch. */
+static gboolean use_shared_encoder = FALSE;
+static GstElement* shared_pipeline = NULL;
+static GstElement* shared_tee = NULL;
+
+/* State for one offer while it is negotiated on the GStreamer threads. The HTTP
+ * request stays pending on the libevent loop until the answer is complete. */
+struct answer_context {
+  gint refs;
+  gint completed;
+  gint local_description_set;
+  struct event_base* base;
+  struct evhttp_request* req;
+  GstElement* webrtcbin;
+  gulong gathering_handler;
+  GSource* timeout_source;
+};
+
+/* Reply to be sent on the libevent thread. */
+struct answer_reply {
+  struct evhttp_request* req;
+  int status;
+  char* body;
+};
+
+static void log_msg(gint level, const char* format, ...) G_GNUC_PRINTF(2, 3);
+static void start_logger();
+static void stop_logger();
+static gpointer run_logger(gpointer user_data);
 static void on_http_request_cb(struct evhttp_request* req, void* arg);
-static GstElement* create_webrtc();
+static GstElement* create_webrtc(GstState state);
+static gboolean create_shared_encoder();
+static GstElement* create_shared_webrtc();
+static void connect_webrtc_signals(GstElement* webrtcbin);
+static void request_key_frame(GstElement* webrtcbin);
+static void remove_shared_webrtc(GstElement* webrtcbin);
+static GstPadProbeReturn on_shared_tee_pad_idle(GstPad* pad, GstPadProbeInfo* info, gpointer webrtcbin);
+static gboolean free_shared_webrtc(gpointer webrtcbin);
+static gboolean release_webrtc(gpointer webrtcbin);
+static void schedule_release_webrtc(GstElement* webrtcbin);
+static GstElement* take_webrtc(gboolean* pool_empty);
+static gboolean refill_webrtc_pool(gpointer user_data);
 static void on_negotiation_needed (GstElement* element, gpointer user_data);
 static void send_ice_candidate_message (GstElement* webrtc G_GNUC_UNUSED, guint mlineindex, gchar* candidate, gpointer user_data G_GNUC_UNUSED);
 static void on_new_transceiver (GstElement* object, GstWebRTCRTPTransceiver* candidate, gpointer udata);
 static void on_ice_gathering_state_notify (GstElement* webrtcbin, GParamSpec* pspec, gpointer user_data);
 static void on_ice_connection_state_notify (GstElement* webrtcbin, GParamSpec* pspec, gpointer user_data);
 static void on_connection_state_notify (GstElement* webrtcbin, GParamSpec* pspec, gpointer user_data);
+static struct answer_context* answer_context_ref(struct answer_context* ctx);
+static void answer_context_unref(gpointer ctx);
+static void answer_context_closure_unref(gpointer ctx, GClosure* closure);
+static void complete_answer(struct answer_context* ctx, int status, char* body);
+static void send_answer_reply(evutil_socket_t fd, short events, void* arg);
+static gboolean on_answer_timeout(gpointer ctx);
+static void on_answer_gathering_state_notify (GstElement* webrtcbin, GParamSpec* pspec, gpointer ctx);
+static void try_complete_answer(struct answer_context* ctx);
 static void on_offer_set (GstPromise* promise, gpointer user_data);
 static void on_answer_created (GstPromise* promise, gpointer user_data);
-static void set_offer(GstElement* webrtc, const gchar* sdp_offer_str);
+static void on_answer_set (GstPromise* promise, gpointer user_data);
+static gboolean set_offer(struct answer_context* ctx, const gchar* sdp_offer_str);
 static gboolean bus_call (GstBus* bus, GstMessage* msg, gpointer data);
 
 int main(int argc, char* argv[])
@@ -81,30 +160,81 @@ int main(int argc, char* argv[])
   /* Initialise GStreamer. */
   gst_init (&argc, &argv);
 
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--pool-size") == 0 && i + 1 < argc) {
+      webrtc_pool_size = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--shared-encoder") == 0) {
+      use_shared_encoder = TRUE;
+    }
+    else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+      const char* level = argv[++i];
+      log_level = strcmp(level, "debug") == 0 ? LOG_DEBUG :
+        strcmp(level, "warning") == 0 ? LOG_WARNING :
+        strcmp(level, "error") == 0 ? LOG_ERROR :
+        strcmp(level, "none") == 0 ? LOG_NONE : LOG_INFO;
+    }
+    else if (strcmp(argv[i], "--log-sdp") == 0) {
+      log_sdp = TRUE;
+    }
+    else {
+      printf("Usage: %s [--pool-size N] [--shared-encoder] [--log-level LEVEL] [--log-sdp]\n", argv[0]);
+      printf("  --pool-size N     number of pre-built webrtcbin pipelines kept ready, 0 to disable (default %d)\n", DEFAULT_WEBRTC_POOL_SIZE);
+      printf("  --shared-encoder  encode the test pattern once and fan it out to every peer\n");
+      printf("  --log-level LEVEL debug, info, warning, error or none (default info)\n");
+      printf("  --log-sdp         log the SDP of every offer and answer\n");
+      return strcmp(argv[i], "--help") == 0 ? 0 : -1;
+    }
+  }
+
+  start_logger();
+
   gst_main_loop = g_main_loop_new(NULL, FALSE);
   main_loop_thread = g_thread_new("main_loop", (GThreadFunc)g_main_loop_run, gst_main_loop);
   if (main_loop_thread == NULL) {
-    fprintf(stderr, "Couldn't create a main loop thread.\n");
-    return -1;
+    log_msg(LOG_ERROR, "Couldn't create a main loop thread.");
+    res = -1;
+    goto done;
   }
 
+  if (use_shared_encoder && !create_shared_encoder()) {
+    log_msg(LOG_ERROR, "Couldn't create the shared encoder pipeline.");
+    res = -1;
+    goto done;
+  }
+
+  if (webrtc_pool_size > 0) {
+    webrtc_pool = g_async_queue_new();
+    refill_webrtc_pool(NULL);
+    log_msg(LOG_INFO, "webrtcbin pool filled with %d pipelines.", g_async_queue_length(webrtc_pool));
+  }
+
+  /* Answers are posted to the event_base from GStreamer threads so it needs locking. */
+#ifdef _WIN32
+  evthread_use_windows_threads();
+#else
+  evthread_use_pthreads();
+#endif
+
   /* Initialise libevent HTTP server. */
   base = event_base_new();
   if (!base) {
-    fprintf(stderr, "Couldn't create an event_base: exiting.\n");
-    return -1;
+    log_msg(LOG_ERROR, "Couldn't create an event_base: exiting.");
+    res = -1;
+    goto done;
   }
 
   httpSvr = evhttp_new(base);
   if (!httpSvr) {
-    fprintf(stderr, "couldn't create evhttp. Exiting.\n");
-    return -1;
+    log_msg(LOG_ERROR, "couldn't create evhttp. Exiting.");
+    res = -1;
+    goto done;
   }
 
   res = evhttp_bind_socket(httpSvr, HTTP_SERVER_ADDRESS, HTTP_SERVER_PORT);
   if (res != 0) {
-    fprintf(stderr, "Failed to start HTTP server on %s:%d.\n", HTTP_SERVER_ADDRESS, HTTP_SERVER_PORT);
-    return res;
+    log_msg(LOG_ERROR, "Failed to start HTTP server on %s:%d.", HTTP_SERVER_ADDRESS, HTTP_SERVER_PORT);
+    goto done;
   }
 
   evhttp_set_allowed_methods(httpSvr,
@@ -112,9 +242,9 @@ int main(int argc, char* argv[])
     EVHTTP_REQ_POST |
     EVHTTP_REQ_OPTIONS);
 
-  printf("Waiting for SDP offer on http://%s:%d%s...\n", HTTP_SERVER_ADDRESS, HTTP_SERVER_PORT, HTTP_OFFER_URL);
+  log_msg(LOG_INFO, "Waiting for SDP offer on http://%s:%d%s...", HTTP_SERVER_ADDRESS, HTTP_SERVER_PORT, HTTP_OFFER_URL);
 
-  res = evhttp_set_cb(httpSvr, HTTP_OFFER_URL, on_http_request_cb, NULL);
+  res = evhttp_set_cb(httpSvr, HTTP_OFFER_URL, on_http_request_cb, base);
 
   event_base_dispatch(base);
 
@@ -122,144 +252,351 @@ int main(int argc, char* argv[])
 
   evhttp_free(httpSvr);
 
+  res = 0;
+
+done:
+  /* Every exit goes through here so the queued log lines, including any fatal
+  * error above, are written before the process ends.
+  */
+  stop_logger();
+
 #ifdef _WIN32
   WSACleanup();
 #endif
 
-  return 0;
+  return res;
+}
+
+/**
+* Formats a log line, with a timestamp and level, if the level is enabled and
+* queues it for the logger thread.
+*/
+static void log_msg(gint level, const char* format, ...)
+{
+  static const char* level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+  GDateTime* now;
+  gchar* timestamp;
+  gchar* message;
+  gchar* line;
+  va_list args;
+
+  if (level < log_level) {
+    return;
+  }
+
+  va_start(args, format);
+  message = g_strdup_vprintf(format, args);
+  va_end(args);
+
+  now = g_date_time_new_now_utc();
+  timestamp = g_date_time_format(now, "%Y-%m-%dT%H:%M:%S");
+  line = g_strdup_printf("%s.%03dZ %-5s %s\n", timestamp, g_date_time_get_microsecond(now) / 1000, level_names[level], message);
+  g_date_time_unref(now);
+  g_free(timestamp);
+  g_free(message);
+
+  if (log_queue != NULL) {
+    g_async_queue_push(log_queue, line);
+  }
+  else {
+    fputs(line, stdout);
+    fflush(stdout);
+    g_free(line);
+  }
+}
+
+static void start_logger()
+{
+  log_queue = g_async_queue_new();
+  log_thread = g_thread_new("logger", run_logger, NULL);
+}
+
+static void stop_logger()
+{
+  GAsyncQueue* queue = log_queue;
+
+  if (queue != NULL) {
+    g_async_queue_push(queue, log_stop_marker);
+    g_thread_join(log_thread);
+    log_queue = NULL;
+    g_async_queue_unref(queue);
+  }
+}
+
+/**
+* Waits for a log line and then writes it, along with any others already queued,
+* with a single write.
+*/
+static gpointer run_logger(gpointer user_data)
+{
+  GString* batch = g_string_new(NULL);
+  gboolean stop = FALSE;
+  gchar* line;
+
+  while (!stop) {
+    line = g_async_queue_pop(log_queue);
+    do {
+      if (line == log_stop_marker) {
+        stop = TRUE;
+      }
+      else {
+        g_string_append(batch, line);
+        g_free(line);
+      }
+    } while (!stop && (line = g_async_queue_try_pop(log_queue)) != NULL);
+
+    if (batch->len > 0) {
+      fwrite(batch->str, 1, batch->len, stdout);
+      fflush(stdout);
+      g_string_truncate(batch, 0);
+    }
+  }
+
+  g_string_free(batch, TRUE);
+  return NULL;
 }
 
 /**
 * The handler function for an incoming HTTP request. This is the start of the 
 * handling for any WebRTC peer that wishes to establish a connection. The incoming
-* request MUST have an SDP offer in its body.
+* request MUST have an SDP offer in its body. The request is left pending while the
+* answer is negotiated and is completed from send_answer_reply so the event loop is
+* free to accept other offers in the meantime.
 * @param[in] req: the HTTP request received from the remote client.
-* @param[in] arg: not used.
+* @param[in] arg: the libevent event_base the HTTP server is running on.
 */
 static void on_http_request_cb(struct evhttp_request* req, void* arg)
 {
   const char* uri = evhttp_request_get_uri(req);
   struct evbuffer* http_req_body;
   size_t http_req_body_len;
-  unsigned char* http_req_buffer;
-  const cJSON* sdp_init_offer_json = NULL;
+  char* http_req_buffer;
+  cJSON* sdp_init_offer_json = NULL;
   const cJSON* sdp_json = NULL;
-  cJSON* sdp_json_answer;
-  cJSON* sdp_json_answer_type;
-  cJSON* sdp_json_answer_sdp;
-  char* json_response;
   struct evbuffer* resp_buffer;
-  size_t response_length;
-  int resp_lock = 0;
   GstElement* webrtcbin;
-  GstPromise* create_answer_promise;
-  const GstStructure* answer_reply;
-  GstWebRTCSessionDescription* answer;
-  gchar* answer_sdp_text;
+  struct answer_context* ctx;
 
-  printf("Received HTTP request for %s.\n", uri);
+  log_msg(LOG_DEBUG, "Received HTTP request for %s.", uri);
 
   if (req->type == EVHTTP_REQ_OPTIONS) {
     evhttp_add_header(req->output_headers, "Access-Control-Allow-Origin", "*");
     evhttp_add_header(req->output_headers, "Access-Control-Allow-Methods", "POST");
     evhttp_add_header(req->output_headers, "Access-Control-Allow-Headers", "content-type");
     evhttp_send_reply(req, 200, "OK", NULL);
+    return;
   }
-  else {
 
-    resp_buffer = evbuffer_new();
-    if (!resp_buffer) {
-      fprintf(stderr, "Failed to create HTTP response buffer.\n");
-    }
+  resp_buffer = evbuffer_new();
+  if (!resp_buffer) {
+    log_msg(LOG_ERROR, "Failed to create HTTP response buffer.");
+    return;
+  }
+
+  evhttp_add_header(req->output_headers, "Access-Control-Allow-Origin", "*");
+
+  http_req_body = evhttp_request_get_input_buffer(req);
+  http_req_body_len = evbuffer_get_length(http_req_body);
+
+  if (http_req_body_len > 0) {
+    http_req_buffer = calloc(http_req_body_len + 1, sizeof(char));
+
+    evbuffer_copyout(http_req_body, http_req_buffer, http_req_body_len);
 
-    if (!evbuffer_enable_locking(resp_buffer, NULL)) {
-      fprintf(stderr, "Failed to create a lock for the HTTP response buffer.\n");
+    log_msg(LOG_DEBUG, "HTTP request body length %zu.", http_req_body_len);
+
+    //printf("Body: %s\n", sdp_buffer);
+
+    sdp_init_offer_json = cJSON_Parse(http_req_buffer);
+    free(http_req_buffer);
+
+    if (log_sdp) {
+      char* sdp_offer_text = cJSON_Print(sdp_init_offer_json);
+      log_msg(LOG_INFO, "sdp offer: %s", sdp_offer_text);
+      cJSON_free(sdp_offer_text);
     }
 
-    evhttp_add_header(req->output_headers, "Access-Control-Allow-Origin", "*");
+    sdp_json = cJSON_GetObjectItemCaseSensitive(sdp_init_offer_json, "sdp");
 
-    http_req_body = evhttp_request_get_input_buffer(req);
-    http_req_body_len = evbuffer_get_length(http_req_body);
+    if (cJSON_IsString(sdp_json) && (sdp_json->valuestring != NULL)) {
 
-    if (http_req_body_len > 0) {
-      http_req_buffer = calloc(http_req_body_len + 1, sizeof(char));
+      gboolean pool_empty = FALSE;
+      webrtcbin = take_webrtc(&pool_empty);
 
-      evbuffer_copyout(http_req_body, http_req_buffer, http_req_body_len);
+      if (pool_empty) {
+        evbuffer_add_printf(resp_buffer, "No webrtc pipeline available, try again later.");
+        evhttp_send_reply(req, 503, "Service Unavailable", resp_buffer);
+      }
+      else if (webrtcbin != NULL) {
 
-      printf("HTTP request body length %zu.\n", http_req_body_len);
+        ctx = g_new0(struct answer_context, 1);
+        ctx->refs = 1;
+        ctx->base = arg;
+        ctx->req = req;
+        ctx->webrtcbin = gst_object_ref(webrtcbin);
 
-      //printf("Body: %s\n", sdp_buffer);
+        ctx->gathering_handler = g_signal_connect_data(webrtcbin, "notify::ice-gathering-state",
+          G_CALLBACK(on_answer_gathering_state_notify), answer_context_ref(ctx), answer_context_closure_unref, 0);
 
-      sdp_init_offer_json = cJSON_Parse(http_req_buffer);
+        ctx->timeout_source = g_timeout_source_new_seconds(ANSWER_TIMEOUT_SECONDS);
+        g_source_set_callback(ctx->timeout_source, on_answer_timeout, answer_context_ref(ctx), answer_context_unref);
+        g_source_attach(ctx->timeout_source, NULL);
 
-      printf("sdp offer: %s\n", cJSON_Print(sdp_init_offer_json));
+        if (!set_offer(ctx, sdp_json->valuestring)) {
+          complete_answer(ctx, 400, g_strdup("Could not parse SDP offer."));
+        }
 
-      sdp_json = cJSON_GetObjectItemCaseSensitive(sdp_init_offer_json, "sdp");
+        answer_context_unref(ctx);
+      }
+      else {
+        evbuffer_add_printf(resp_buffer, "Failed to initialise webrtc peer connection.");
+        evhttp_send_reply(req, 501, "Internal Server Error", resp_buffer);
+      }
+    }
+    else {
+      evbuffer_add_printf(resp_buffer, "Could not parse SDP offer.");
+      evhttp_send_reply(req, 400, "Bad Request", resp_buffer);
+    }
 
-      if (cJSON_IsString(sdp_json) && (sdp_json->valuestring != NULL)) {
+    cJSON_Delete(sdp_init_offer_json);
+  }
+  else {
+    evbuffer_add_printf(resp_buffer, "Request was missing the SDP offer.");
+    evhttp_send_reply(req, 400, "Bad Request", resp_buffer);
+  }
 
-        webrtcbin = create_webrtc();
+  evbuffer_free(resp_buffer);
+}
 
-        if (webrtcbin != NULL) {
+static struct answer_context* answer_context_ref(struct answer_context* ctx)
+{
+  g_atomic_int_inc(&ctx->refs);
+  return ctx;
+}
 
-          set_offer(webrtcbin, sdp_json->valuestring);
+static void answer_context_unref(gpointer user_data)
+{
+  struct answer_context* ctx = user_data;
 
-          create_answer_promise = gst_promise_new();
-          g_signal_emit_by_name(webrtcbin, "create-answer", NULL, create_answer_promise);
+  if (g_atomic_int_dec_and_test(&ctx->refs)) {
+    g_source_unref(ctx->timeout_source);
+    gst_object_unref(ctx->webrtcbin);
+    g_free(ctx);
+  }
+}
 
-          if (gst_promise_wait(create_answer_promise) == GST_PROMISE_RESULT_REPLIED) {
+static void answer_context_closure_unref(gpointer ctx, GClosure* closure)
+{
+  answer_context_unref(ctx);
+}
 
-            printf("create-answer promise wait over.\n");
+/**
+* Completes the pending HTTP request for an offer. Only the first call has any
+* effect, later ones, e.g. from the timeout, just free the body. The reply itself
+* is sent on the libevent thread.
+* @param[in] ctx: the answer context for the offer.
+* @param[in] status: the HTTP status code.
+* @param[in] body: the response body, ownership is taken.
+*/
+static void complete_answer(struct answer_context* ctx, int status, char* body)
+{
+  struct answer_reply* reply;
 
-            answer_reply = gst_promise_get_reply (create_answer_promise);
+  if (!g_atomic_int_compare_and_exchange(&ctx->completed, 0, 1)) {
+    g_free(body);
+    return;
+  }
 
-            gst_structure_get (answer_reply, "answer", GST_TYPE_WEBRTC_SESSION_DESCRIPTION, &answer, NULL);
-            gst_promise_unref (create_answer_promise);
+  g_source_destroy(ctx->timeout_source);
+  g_signal_handler_disconnect(ctx->webrtcbin, ctx->gathering_handler);
 
-            if (answer != NULL) {
+  if (status != 200) {
+    /* Nothing else will ever release the webrtcbin of a failed offer. */
+    schedule_release_webrtc(ctx->webrtcbin);
+  }
 
-              answer_sdp_text = gst_sdp_message_as_text(answer->sdp);
-              gst_webrtc_session_description_free (answer);
+  reply = g_new0(struct answer_reply, 1);
+  reply->req = ctx->req;
+  reply->status = status;
+  reply->body = body;
 
-              sdp_json_answer = cJSON_CreateObject();
-              sdp_json_answer_type = cJSON_CreateString("answer");
-              cJSON_AddItemToObject(sdp_json_answer, "type", sdp_json_answer_type);
-              sdp_json_answer_sdp = cJSON_CreateString(answer_sdp_text);
-              cJSON_AddItemToObject(sdp_json_answer, "sdp", sdp_json_answer_sdp);
-              json_response = cJSON_Print(sdp_json_answer);
+  if (event_base_once(ctx->base, -1, EV_TIMEOUT, send_answer_reply, reply, NULL) != 0) {
+    log_msg(LOG_ERROR, "Failed to schedule the HTTP reply.");
+    g_free(reply->body);
+    g_free(reply);
+  }
+}
 
-              printf("Return SDP answer to client: %s.\n", json_response);
+static void send_answer_reply(evutil_socket_t fd, short events, void* arg)
+{
+  struct answer_reply* reply = arg;
+  struct evbuffer* resp_buffer = evbuffer_new();
 
-              response_length = strlen(json_response);
-              evhttp_add_header(req->output_headers, "Content-type", "application/json");
-              evbuffer_add(resp_buffer, json_response, response_length);
-              evhttp_send_reply(req, 200, "OK", resp_buffer);
-            }
-            else {
-              evbuffer_add_printf(resp_buffer, "Failed to get webrtc SDP answer.");
-              evhttp_send_reply(req, 501, "Internal Server Error", resp_buffer);
-            }
-          }
-          else {
-            evbuffer_add_printf(resp_buffer, "Timed out waiting for webrtc SDP answer.");
-            evhttp_send_reply(req, 501, "Internal Server Error", resp_buffer);
-          }
-        }
-        else {
-          evbuffer_add_printf(resp_buffer, "Failed to initialise webrtc peer connection.");
-          evhttp_send_reply(req, 501, "Internal Server Error", resp_buffer);
-        }
-      }
-      else {
-        evbuffer_add_printf(resp_buffer, "Could not parse SDP offer.");
-        evhttp_send_reply(req, 400, "Bad Request", resp_buffer);
-      }
-    }
-    else {
-      evbuffer_add_printf(resp_buffer, "Request was missing the SDP offer.");
-      evhttp_send_reply(req, 400, "Bad Request", resp_buffer);
+  if (reply->status == 200) {
+    if (log_sdp) {
+      log_msg(LOG_INFO, "Return SDP answer to client: %s.", reply->body);
     }
+    evhttp_add_header(reply->req->output_headers, "Content-type", "application/json");
   }
+
+  evbuffer_add(resp_buffer, reply->body, strlen(reply->body));
+  evhttp_send_reply(reply->req, reply->status, reply->status == 200 ? "OK" : NULL, resp_buffer);
+
+  evbuffer_free(resp_buffer);
+  g_free(reply->body);
+  g_free(reply);
+}
+
+static gboolean on_answer_timeout(gpointer ctx)
+{
+  complete_answer(ctx, 504, g_strdup("Timed out waiting for webrtc SDP answer."));
+  return G_SOURCE_REMOVE;
+}
+
+static void on_answer_gathering_state_notify (GstElement* webrtcbin, GParamSpec* pspec, gpointer ctx)
+{
+  try_complete_answer(ctx);
+}
+
+/**
+* Sends the answer once both the local description has been set and ICE gathering
+* has completed, whichever happens last.
+*/
+static void try_complete_answer(struct answer_context* ctx)
+{
+  GstWebRTCICEGatheringState ice_gathering_state = 0;
+  GstWebRTCSessionDescription* answer = NULL;
+  gchar* answer_sdp_text;
+  cJSON* sdp_json_answer;
+  char* json_response;
+
+  if (!g_atomic_int_get(&ctx->local_description_set)) {
+    return;
+  }
+
+  g_object_get (G_OBJECT (ctx->webrtcbin), "ice-gathering-state", &ice_gathering_state, NULL);
+  if (ice_gathering_state != GST_WEBRTC_ICE_GATHERING_STATE_COMPLETE) {
+    return;
+  }
+
+  g_object_get (G_OBJECT (ctx->webrtcbin), "local-description", &answer, NULL);
+  if (answer == NULL) {
+    complete_answer(ctx, 500, g_strdup("Failed to get webrtc SDP answer."));
+    return;
+  }
+
+  answer_sdp_text = gst_sdp_message_as_text(answer->sdp);
+  gst_webrtc_session_description_free (answer);
+
+  sdp_json_answer = cJSON_CreateObject();
+  cJSON_AddItemToObject(sdp_json_answer, "type", cJSON_CreateString("answer"));
+  cJSON_AddItemToObject(sdp_json_answer, "sdp", cJSON_CreateString(answer_sdp_text));
+  json_response = cJSON_Print(sdp_json_answer);
+  cJSON_Delete(sdp_json_answer);
+  g_free(answer_sdp_text);
+
+  complete_answer(ctx, 200, g_strdup(json_response));
+  cJSON_free(json_response);
 }
 
 /**
@@ -267,15 +604,21 @@ static void on_http_request_cb(struct evhttp_request* req, void* arg)
 * for important events are attached to the WebRTC object and will be
 * responsible for progressing the WebRTC connection subsequent to its
 * creation.
+* @param[in] state: the state the pipeline is started in, READY for a pipeline
+* that waits in the pool so its test source and encoder aren't running.
 * @@Returns a new WebRTC object.
 */
-static GstElement* create_webrtc()
+static GstElement* create_webrtc(GstState state)
 {
   GstElement* pipeline, * webrtcbin;
   GstBus* bus;
   GstStateChangeReturn ret;
   GError* error = NULL;
 
+  if (use_shared_encoder) {
+    return create_shared_webrtc();
+  }
+
   pipeline =
      gst_parse_launch ("webrtcbin bundle-policy=max-bundle name=sendonly "
        "videotestsrc is-live=true pattern=ball ! videoconvert ! queue ! vp8enc deadline=1 ! rtpvp8pay ! "
@@ -289,7 +632,7 @@ static GstElement* create_webrtc()
   //    , &error);
 
   if (error) {
-    gst_printerr ("Failed to parse launch: %s\n", error->message);
+    log_msg(LOG_ERROR, "Failed to parse launch: %s", error->message);
     g_error_free (error);
     return NULL;
   }
@@ -298,17 +641,35 @@ static GstElement* create_webrtc()
   webrtcbin = gst_element_factory_make ("webrtcbin", "webrtcx");
 
   if (!pipeline || !webrtcbin) {
-    g_printerr("Unable to initialise echo test pipeline.\n");
+    log_msg(LOG_ERROR, "Unable to initialise echo test pipeline.");
   }
 
   gst_bin_add_many (GST_BIN (pipeline), webrtcbin, NULL);
   if (gst_element_link (webrtcbin, webrtcbin) != TRUE) {
-    g_printerr ("Elements could not be linked.\n");
+    log_msg(LOG_ERROR, "Elements could not be linked.");
   }*/
 
   webrtcbin = gst_bin_get_by_name (GST_BIN (pipeline), "sendonly");
   g_assert_nonnull (webrtcbin);
 
+  connect_webrtc_signals(webrtcbin);
+
+  ret = gst_element_set_state (pipeline, state);
+  if (ret == GST_STATE_CHANGE_FAILURE) {
+    log_msg(LOG_ERROR, "Unable to set the pipeline to the %s state.", gst_element_state_get_name (state));
+    gst_object_unref(pipeline);
+    return NULL;
+  }
+
+  bus = gst_element_get_bus (pipeline);
+  gst_bus_add_watch (bus, bus_call, NULL);
+  gst_object_unref (bus);
+
+  return webrtcbin;
+}
+
+static void connect_webrtc_signals(GstElement* webrtcbin)
+{
   g_signal_connect (webrtcbin, "on-negotiation-needed", G_CALLBACK (on_negotiation_needed), NULL);
   g_signal_connect (webrtcbin, "on-ice-candidate", G_CALLBACK (send_ice_candidate_message), NULL);
   g_signal_connect (webrtcbin, "on-new-transceiver", G_CALLBACK (on_new_transceiver), NULL);
@@ -316,90 +677,361 @@ static GstElement* create_webrtc()
   g_signal_connect (webrtcbin, "notify::ice-gathering-state", G_CALLBACK (on_ice_gathering_state_notify), NULL);
   g_signal_connect (webrtcbin, "notify::ice-connection-state", G_CALLBACK (on_ice_connection_state_notify), NULL);
   g_signal_connect (webrtcbin, "notify::connection-state", G_CALLBACK (on_connection_state_notify), NULL);
-  
-  /* Start playing */
-  ret = gst_element_set_state (pipeline, GST_STATE_PLAYING);
-  if (ret == GST_STATE_CHANGE_FAILURE) {
-    g_printerr("Unable to set the pipeline to the playing state.\n");
-    gst_object_unref(pipeline);
-    return NULL;
+}
+
+/**
+* Creates the single live encode branch that all webrtcbin instances are fed from
+* when the shared encoder mode is enabled.
+* @@Returns TRUE if the shared pipeline is playing.
+*/
+static gboolean create_shared_encoder()
+{
+  GstBus* bus;
+  GError* error = NULL;
+
+  shared_pipeline =
+    gst_parse_launch ("videotestsrc is-live=true pattern=ball ! videoconvert ! queue ! vp8enc deadline=1 ! rtpvp8pay ! "
+      RTP_CAPS_VP8 " ! tee name=rtptee allow-not-linked=true"
+      , &error);
+
+  if (error) {
+    log_msg(LOG_ERROR, "Failed to parse launch: %s", error->message);
+    g_error_free (error);
+    return FALSE;
   }
 
-  bus = gst_element_get_bus (pipeline);
+  shared_tee = gst_bin_get_by_name (GST_BIN (shared_pipeline), "rtptee");
+  g_assert_nonnull (shared_tee);
+
+  bus = gst_element_get_bus (shared_pipeline);
   gst_bus_add_watch (bus, bus_call, NULL);
   gst_object_unref (bus);
 
+  if (gst_element_set_state (shared_pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+    log_msg(LOG_ERROR, "Unable to set the shared encoder pipeline to the playing state.");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+* Adds a new queue and webrtcbin branch to the shared encoder tee. The tee pad and
+* queue are stored on the webrtcbin so the branch can be removed or asked for a
+* key frame later.
+* @@Returns a new WebRTC object.
+*/
+static GstElement* create_shared_webrtc()
+{
+  GstElement* queue, * webrtcbin;
+  GstPad* tee_pad, * queue_pad;
+
+  queue = gst_element_factory_make ("queue", NULL);
+  webrtcbin = gst_element_factory_make ("webrtcbin", NULL);
+
+  if (!queue || !webrtcbin) {
+    log_msg(LOG_ERROR, "Unable to create the shared encoder branch.");
+    return NULL;
+  }
+
+  /* A slow peer drops packets rather than stalling the encoder for everyone. */
+  g_object_set (queue, "leaky", 2, NULL);
+  gst_util_set_object_arg (G_OBJECT (webrtcbin), "bundle-policy", "max-bundle");
+
+  connect_webrtc_signals(webrtcbin);
+
+  gst_bin_add_many (GST_BIN (shared_pipeline), queue, webrtcbin, NULL);
+
+  if (!gst_element_link (queue, webrtcbin)) {
+    log_msg(LOG_ERROR, "Unable to link the shared encoder branch.");
+    gst_bin_remove_many (GST_BIN (shared_pipeline), queue, webrtcbin, NULL);
+    return NULL;
+  }
+
+  gst_element_sync_state_with_parent (webrtcbin);
+  gst_element_sync_state_with_parent (queue);
+
+  tee_pad = gst_element_request_pad_simple (shared_tee, "src_%u");
+  queue_pad = gst_element_get_static_pad (queue, "sink");
+  gst_pad_link (tee_pad, queue_pad);
+  gst_object_unref (queue_pad);
+
+  g_object_set_data (G_OBJECT (webrtcbin), "shared-queue", queue);
+  g_object_set_data (G_OBJECT (webrtcbin), "shared-tee-pad", tee_pad);
+
+  /* Match the reference returned by gst_bin_get_by_name in create_webrtc. */
+  return gst_object_ref (webrtcbin);
+}
+
+/**
+* Asks the shared encoder for a key frame so a newly connected peer can start
+* decoding without waiting for the next scheduled one.
+*/
+static void request_key_frame(GstElement* webrtcbin)
+{
+  GstElement* queue = g_object_get_data (G_OBJECT (webrtcbin), "shared-queue");
+  GstPad* queue_pad;
+
+  if (queue != NULL) {
+    queue_pad = gst_element_get_static_pad (queue, "sink");
+    gst_pad_push_event (queue_pad, gst_video_event_new_upstream_force_key_unit (GST_CLOCK_TIME_NONE, TRUE, 0));
+    gst_object_unref (queue_pad);
+  }
+}
+
+/**
+* Detaches a webrtcbin branch from the shared encoder tee. The tee pad is unlinked
+* once idle and the elements are shut down from the main loop.
+*/
+static void remove_shared_webrtc(GstElement* webrtcbin)
+{
+  GstPad* tee_pad = g_object_get_data (G_OBJECT (webrtcbin), "shared-tee-pad");
+
+  if (tee_pad != NULL) {
+    g_object_set_data (G_OBJECT (webrtcbin), "shared-tee-pad", NULL);
+    gst_pad_add_probe (tee_pad, GST_PAD_PROBE_TYPE_IDLE, on_shared_tee_pad_idle, webrtcbin, NULL);
+  }
+}
+
+static GstPadProbeReturn on_shared_tee_pad_idle(GstPad* pad, GstPadProbeInfo* info, gpointer webrtcbin)
+{
+  GstPad* peer = gst_pad_get_peer (pad);
+
+  if (peer != NULL) {
+    gst_pad_unlink (pad, peer);
+    gst_object_unref (peer);
+  }
+  gst_element_release_request_pad (shared_tee, pad);
+  gst_object_unref (pad);
+
+  g_idle_add (free_shared_webrtc, webrtcbin);
+
+  return GST_PAD_PROBE_REMOVE;
+}
+
+static gboolean free_shared_webrtc(gpointer webrtcbin)
+{
+  GstElement* queue = g_object_get_data (G_OBJECT (webrtcbin), "shared-queue");
+
+  gst_element_set_state (queue, GST_STATE_NULL);
+  gst_element_set_state (webrtcbin, GST_STATE_NULL);
+  gst_bin_remove_many (GST_BIN (shared_pipeline), queue, webrtcbin, NULL);
+  gst_object_unref (webrtcbin);
+
+  return G_SOURCE_REMOVE;
+}
+
+/**
+* Shuts down a webrtcbin whose offer failed or whose connection has ended. With the
+* shared encoder its branch is removed from the tee, otherwise the pipeline created
+* for it is stopped and freed. Takes over the reference passed to it and the one
+* returned by take_webrtc.
+*/
+static gboolean release_webrtc(gpointer webrtcbin)
+{
+  GstElement* pipeline;
+  GstBus* bus;
+
+  if (use_shared_encoder) {
+    remove_shared_webrtc(webrtcbin);
+  }
+  else {
+    pipeline = GST_ELEMENT (gst_element_get_parent (webrtcbin));
+    if (pipeline != NULL) {
+      bus = gst_element_get_bus (pipeline);
+      gst_bus_remove_watch (bus);
+      gst_object_unref (bus);
+
+      gst_element_set_state (pipeline, GST_STATE_NULL);
+      gst_object_unref (pipeline); /* gst_element_get_parent */
+      gst_object_unref (pipeline); /* gst_parse_launch in create_webrtc */
+    }
+    gst_object_unref (webrtcbin);
+  }
+
+  gst_object_unref (webrtcbin);
+  return G_SOURCE_REMOVE;
+}
+
+/**
+* Queues a webrtcbin to be released on the main loop, since this can be called from
+* a webrtcbin thread. Disconnecting the connection state handler makes sure only the
+* first of a failed offer and the terminal connection states releases it.
+*/
+static void schedule_release_webrtc(GstElement* webrtcbin)
+{
+  if (g_signal_handlers_disconnect_by_func (webrtcbin, G_CALLBACK (on_connection_state_notify), NULL) > 0) {
+    g_idle_add(release_webrtc, gst_object_ref(webrtcbin));
+  }
+}
+
+/**
+* Gets a webrtcbin for a new offer. With the pool enabled a ready pipeline is taken
+* from the pool and a background refill is scheduled on the GStreamer main loop.
+* @param[out] pool_empty: set to TRUE if the pool was enabled but had no pipeline
+* available, in which case the offer should be rejected.
+* @@Returns a webrtcbin that is playing or NULL.
+*/
+static GstElement* take_webrtc(gboolean* pool_empty)
+{
+  GstElement* webrtcbin, * pipeline;
+  GstStateChangeReturn ret;
+
+  *pool_empty = FALSE;
+
+  if (webrtc_pool == NULL) {
+    return create_webrtc(GST_STATE_PLAYING);
+  }
+
+  webrtcbin = g_async_queue_try_pop(webrtc_pool);
+
+  if (g_atomic_int_compare_and_exchange(&webrtc_pool_refill_scheduled, 0, 1)) {
+    g_idle_add(refill_webrtc_pool, NULL);
+  }
+
+  if (webrtcbin == NULL) {
+    log_msg(LOG_WARNING, "webrtcbin pool is empty.");
+    *pool_empty = TRUE;
+  }
+  else if (!use_shared_encoder) {
+    /* Pooled pipelines wait in READY, shared encoder branches are already fed by the
+     * running shared pipeline. */
+    pipeline = GST_ELEMENT (gst_element_get_parent (webrtcbin));
+    ret = gst_element_set_state (pipeline, GST_STATE_PLAYING);
+    gst_object_unref (pipeline);
+
+    if (ret == GST_STATE_CHANGE_FAILURE) {
+      log_msg(LOG_ERROR, "Unable to set a pooled pipeline to the playing state.");
+      schedule_release_webrtc(webrtcbin);
+      webrtcbin = NULL;
+    }
+  }
+
   return webrtcbin;
 }
 
 /**
-* 
-* @param[in] webrtc: the HTTP request received from the remote client.
-* @param[in] sdp_offer_str: not used.
+* Tops the pool back up to its configured size. Runs on the GStreamer main loop
+* thread so pipeline construction stays off the HTTP request path.
 */
-static void set_offer(GstElement* webrtc, const gchar* sdp_offer_str)
+static gboolean refill_webrtc_pool(gpointer user_data)
+{
+  GstElement* webrtcbin;
+
+  g_atomic_int_set(&webrtc_pool_refill_scheduled, 0);
+
+  while (g_async_queue_length(webrtc_pool) < webrtc_pool_size) {
+    webrtcbin = create_webrtc(GST_STATE_READY);
+    if (webrtcbin == NULL) {
+      break;
+    }
+    g_async_queue_push(webrtc_pool, webrtcbin);
+  }
+
+  return G_SOURCE_REMOVE;
+}
+
+/**
+* Starts the answer chain: set-remote-description, create-answer,
+* set-local-description and then ICE gathering. Each step is driven from the
+* previous step's promise so nothing waits on a GStreamer thread.
+* @param[in] ctx: the answer context for the offer.
+* @param[in] sdp_offer_str: the SDP offer received from the client.
+* @Returns FALSE if the SDP offer could not be parsed.
+*/
+static gboolean set_offer(struct answer_context* ctx, const gchar* sdp_offer_str)
 {
   GstWebRTCSessionDescription* offer = NULL;
   GstPromise* promise;
   GstSDPMessage* sdp;
   int ret;
 
-  printf("set_offer.\n");
+  log_msg(LOG_DEBUG, "set_offer.");
 
   ret = gst_sdp_message_new (&sdp);
   g_assert_cmphex (ret, == , GST_SDP_OK);
-  ret = gst_sdp_message_parse_buffer (sdp_offer_str, (guint)strlen (sdp_offer_str), sdp);
-  g_assert_cmphex (ret, == , GST_SDP_OK);
+  ret = gst_sdp_message_parse_buffer ((const guint8*)sdp_offer_str, (guint)strlen (sdp_offer_str), sdp);
+  if (ret != GST_SDP_OK) {
+    gst_sdp_message_free (sdp);
+    return FALSE;
+  }
 
   offer = gst_webrtc_session_description_new (GST_WEBRTC_SDP_TYPE_OFFER, sdp);
   g_assert_nonnull (offer);
 
   /* Set remote description on our pipeline */
-  promise = gst_promise_new_with_change_func (on_offer_set, webrtc, NULL);
-  g_signal_emit_by_name (webrtc, "set-remote-description", offer, promise);
+  promise = gst_promise_new_with_change_func (on_offer_set, answer_context_ref(ctx), answer_context_unref);
+  g_signal_emit_by_name (ctx->webrtcbin, "set-remote-description", offer, promise);
+  gst_webrtc_session_description_free (offer);
+
+  return TRUE;
 }
 
-static void on_offer_set (GstPromise* promise, gpointer webrtc)
+static void on_offer_set (GstPromise* promise, gpointer user_data)
 {
-  const GstStructure* reply;
-  const GstPromise* answer_promise;
+  struct answer_context* ctx = user_data;
+  GstPromise* answer_promise;
+  GstPromiseResult result;
 
-  printf("on_offer_set.\n");
+  log_msg(LOG_DEBUG, "on_offer_set.");
 
-  reply = gst_promise_get_reply (promise);
+  result = gst_promise_wait (promise);
   gst_promise_unref (promise);
 
-  answer_promise = gst_promise_new_with_change_func (on_answer_created, webrtc, NULL);
-  g_signal_emit_by_name (webrtc, "create-answer", NULL, answer_promise);
+  if (result != GST_PROMISE_RESULT_REPLIED) {
+    complete_answer(ctx, 500, g_strdup("Failed to set webrtc SDP offer."));
+    return;
+  }
+
+  answer_promise = gst_promise_new_with_change_func (on_answer_created, answer_context_ref(ctx), answer_context_unref);
+  g_signal_emit_by_name (ctx->webrtcbin, "create-answer", NULL, answer_promise);
 }
 
-/* Answer created by our pipeline, to be sent to the peer */
-static void on_answer_created (GstPromise* promise, gpointer webrtc)
+/* Answer created by our pipeline, to be set as the local description */
+static void on_answer_created (GstPromise* promise, gpointer user_data)
 {
-  GstWebRTCSessionDescription* answer;
+  struct answer_context* ctx = user_data;
+  GstWebRTCSessionDescription* answer = NULL;
   const GstStructure* reply;
-  const gchar* answer_sdp_text = NULL;
   GstPromise* set_local_promise;
 
-  printf("on_answer_created.\n");
+  log_msg(LOG_DEBUG, "on_answer_created.");
 
-  g_assert_cmphex (gst_promise_wait (promise), == , GST_PROMISE_RESULT_REPLIED);
-  reply = gst_promise_get_reply (promise);
-  gst_structure_get (reply, "answer", GST_TYPE_WEBRTC_SESSION_DESCRIPTION, &answer, NULL);
+  if (gst_promise_wait (promise) == GST_PROMISE_RESULT_REPLIED) {
+    reply = gst_promise_get_reply (promise);
+    gst_structure_get (reply, "answer", GST_TYPE_WEBRTC_SESSION_DESCRIPTION, &answer, NULL);
+  }
   gst_promise_unref (promise);
 
-  set_local_promise = gst_promise_new ();
-  g_signal_emit_by_name (webrtc, "set-local-description", answer, set_local_promise);
-  gst_promise_interrupt (set_local_promise);
-  gst_promise_unref (set_local_promise);
+  if (answer == NULL) {
+    complete_answer(ctx, 500, g_strdup("Failed to get webrtc SDP answer."));
+    return;
+  }
 
-  //answer_sdp_text = gst_sdp_message_as_text(answer->sdp);
+  set_local_promise = gst_promise_new_with_change_func (on_answer_set, answer_context_ref(ctx), answer_context_unref);
+  g_signal_emit_by_name (ctx->webrtcbin, "set-local-description", answer, set_local_promise);
 
-  //printf("Answer SDP: %s.\n", answer_sdp_text);
+  gst_webrtc_session_description_free (answer);
+}
 
-  //_sdp_answer_str = answer_sdp_text;
+/* Local description set, ICE gathering is now under way */
+static void on_answer_set (GstPromise* promise, gpointer user_data)
+{
+  struct answer_context* ctx = user_data;
+  GstPromiseResult result;
 
-  gst_webrtc_session_description_free (answer);
+  log_msg(LOG_DEBUG, "on_answer_set.");
+
+  result = gst_promise_wait (promise);
+  gst_promise_unref (promise);
+
+  if (result != GST_PROMISE_RESULT_REPLIED) {
+    complete_answer(ctx, 500, g_strdup("Failed to set webrtc SDP answer."));
+    return;
+  }
+
+  g_atomic_int_set(&ctx->local_description_set, 1);
+  try_complete_answer(ctx);
 }
 
 static void on_negotiation_needed (GstElement* element, gpointer user_data)
@@ -408,21 +1040,21 @@ static void on_negotiation_needed (GstElement* element, gpointer user_data)
   GstWebRTCSignalingState signalingState = 0;
   GstWebRTCSessionDescription* remoteDescription = NULL;
 
-  printf("on_negotiation_needed\n");
+  log_msg(LOG_DEBUG, "on_negotiation_needed");
 
   g_object_get (G_OBJECT (element), "name", &name, NULL);
-  g_print ("The name of the element is '%s'.\n", name);
+  log_msg(LOG_DEBUG, "The name of the element is '%s'.", name);
   g_free (name);
 
   g_object_get (G_OBJECT (element), "signaling-state", &signalingState, NULL);
-  g_print ("The signaling state of the element is '%d'.\n", signalingState);
+  log_msg(LOG_DEBUG, "The signaling state of the element is '%d'.", signalingState);
 
   g_object_get (G_OBJECT (element), "remote-description", &remoteDescription, NULL);
   if (remoteDescription == NULL) {
-    g_print("Remote description is not set.\n");
+    log_msg(LOG_DEBUG, "Remote description is not set.");
   }
   else {
-    g_print("Remote description is set.\n");
+    log_msg(LOG_DEBUG, "Remote description is set.");
   }
 }
 
@@ -434,33 +1066,37 @@ static void send_ice_candidate_message (GstElement* webrtc G_GNUC_UNUSED, guint
 
 static void on_new_transceiver (GstElement* object, GstWebRTCRTPTransceiver* candidate, gpointer udata)
 {
-  g_print("on_new_transceiver.\n");
+  log_msg(LOG_DEBUG, "on_new_transceiver.");
 }
 
 static void on_ice_gathering_state_notify (GstElement* webrtcbin, GParamSpec* pspec, gpointer user_data)
 {
   GstWebRTCICEGatheringState ice_gathering_state = 0;
   g_object_get (G_OBJECT (webrtcbin), "ice-gathering-state", &ice_gathering_state, NULL);
-  g_print ("on_ice_gathering_state_notify '%d'.\n", ice_gathering_state);
+  log_msg(LOG_DEBUG, "on_ice_gathering_state_notify '%d'.", ice_gathering_state);
 }
 
 static void on_ice_connection_state_notify (GstElement* webrtcbin, GParamSpec* pspec, gpointer user_data)
 {
   GstWebRTCICEConnectionState ice_connection_state = 0;
   g_object_get (G_OBJECT (webrtcbin), "ice-connection-state", &ice_connection_state, NULL);
-  g_print ("on_ice_connection_state_notify '%d'.\n", ice_connection_state);
+  log_msg(LOG_DEBUG, "on_ice_connection_state_notify '%d'.", ice_connection_state);
 }
 
 static void on_connection_state_notify (GstElement* webrtcbin, GParamSpec* pspec, gpointer user_data)
 {
   GstWebRTCPeerConnectionState connection_state = 0;
   g_object_get (G_OBJECT (webrtcbin), "connection-state", &connection_state, NULL);
-  g_print ("on_connection_state_notify '%d'.\n", connection_state);
+  log_msg(LOG_DEBUG, "on_connection_state_notify '%d'.", connection_state);
 
-  if (connection_state == GST_WEBRTC_PEER_CONNECTION_STATE_FAILED) {
-    g_print("Peer connections failed, shutting down pipeline.\n");
-    gst_element_set_state (webrtcbin, GST_STATE_NULL);
-    gst_object_unref (webrtcbin);
+  if (connection_state == GST_WEBRTC_PEER_CONNECTION_STATE_CONNECTED && use_shared_encoder) {
+    request_key_frame(webrtcbin);
+  }
+  else if (connection_state == GST_WEBRTC_PEER_CONNECTION_STATE_FAILED ||
+    connection_state == GST_WEBRTC_PEER_CONNECTION_STATE_DISCONNECTED ||
+    connection_state == GST_WEBRTC_PEER_CONNECTION_STATE_CLOSED) {
+    log_msg(LOG_INFO, "Peer connection ended with state %d, shutting down pipeline.", connection_state);
+    schedule_release_webrtc(webrtcbin);
   }
 }
 
@@ -473,7 +1109,7 @@ static gboolean bus_call (GstBus* bus, GstMessage* msg, gpointer data)
   switch (GST_MESSAGE_TYPE (msg)) {
 
   case GST_MESSAGE_EOS:
-    g_print ("End of stream\n");
+    log_msg(LOG_INFO, "End of stream");
     //g_main_loop_quit (loop);
     break;
 
@@ -484,7 +1120,7 @@ static gboolean bus_call (GstBus* bus, GstMessage* msg, gpointer data)
     gst_message_parse_error (msg, &error, &debug);
     g_free (debug);
 
-    g_printerr ("Error: %s\n", error->message);
+    log_msg(LOG_ERROR, "Error: %s", error->message);
     g_error_free (error);
 
     //g_main_loop_quit (loop);
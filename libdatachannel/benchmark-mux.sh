@@ -0,0 +1,50 @@
+#!/bin/bash
+# Compares the server with one UDP socket per connection against the ICE UDP mux.
+# For each mode and session count it runs the client load test against a fresh
+# server, samples the peak file descriptor count and RSS of the server from /proc
+# while the sessions are open, and prints them with the client's JSON report,
+# which has the setup time per phase.
+#
+# Usage: ./benchmark-mux.sh [BUILD_DIR] [SESSIONS...] (default build 1000 5000)
+# Environment: RATE new sessions per second (default 100), HOLD seconds (default 20)
+
+BUILD=${1:-build}
+shift
+COUNTS=${@:-1000 5000}
+RATE=${RATE:-100}
+HOLD=${HOLD:-20}
+
+# Both processes need a descriptor per socket without the mux
+ulimit -n 65536
+
+for MODE in default mux; do
+	for COUNT in $COUNTS; do
+		if [ "$MODE" = "mux" ]; then
+			"$BUILD/server" -i 0 -I 0 -m > /dev/null &
+		else
+			"$BUILD/server" -i 0 -I 0 > /dev/null &
+		fi
+		SERVER=$!
+		sleep 2
+
+		"$BUILD/client" -t 3 -c "$COUNT" -a "$RATE" -d "$HOLD" -j > client.json &
+		CLIENT=$!
+
+		FDS=0
+		RSS=0
+		while kill -0 $CLIENT 2> /dev/null; do
+			N=$(ls /proc/$SERVER/fd 2> /dev/null | wc -l)
+			R=$(awk '/VmRSS/ { print $2 }' /proc/$SERVER/status 2> /dev/null)
+			[ "$N" -gt "$FDS" ] && FDS=$N
+			[ "${R:-0}" -gt "$RSS" ] && RSS=$R
+			sleep 1
+		done
+
+		kill $SERVER
+		wait $SERVER 2> /dev/null
+
+		echo "$MODE $COUNT sessions: server peak $FDS file descriptors, $((RSS / 1024)) MiB RSS"
+		cat client.json
+		rm -f client.json
+	done
+done
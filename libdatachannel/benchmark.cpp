@@ -0,0 +1,193 @@
+/*
+ * libdatachannel echo signalling benchmark
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Fires a burst of SDP offers at an echo server and reports offers/sec and
+// answer latency percentiles. A single offer is gathered once and replayed so
+// that only the server side of the signalling path is measured.
+
+#include <httplib.h>
+#include <nlohmann/json.hpp>
+#include <rtc/rtc.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace http = httplib;
+using json = nlohmann::json;
+
+using namespace std::chrono_literals;
+using clock_type = std::chrono::steady_clock;
+
+std::string gatherOffer() {
+	std::promise<std::string> promise;
+	auto future = promise.get_future();
+
+	rtc::Configuration config;
+	config.disableAutoNegotiation = true;
+	rtc::PeerConnection pc{std::move(config)};
+
+	pc.onGatheringStateChange([&pc, &promise](rtc::PeerConnection::GatheringState state) {
+		if (state == rtc::PeerConnection::GatheringState::Complete) {
+			auto local = pc.localDescription().value();
+			json msg;
+			msg["sdp"] = std::string(local);
+			msg["type"] = local.typeString();
+			promise.set_value(msg.dump());
+		}
+	});
+
+	rtc::Description::Video media("echo", rtc::Description::Direction::SendRecv);
+	media.addVP8Codec(96);
+	auto tr = pc.addTrack(std::move(media));
+	auto dc = pc.createDataChannel("echo");
+
+	pc.setLocalDescription(rtc::Description::Type::Offer);
+
+	if (future.wait_for(10s) != std::future_status::ready)
+		throw std::runtime_error("Timeout gathering offer");
+
+	auto offer = future.get();
+	pc.close();
+	return offer;
+}
+
+double percentile(const std::vector<double> &sorted, double p) {
+	if (sorted.empty())
+		return 0.;
+
+	auto index = std::size_t(p * double(sorted.size() - 1) + 0.5);
+	return sorted[std::min(index, sorted.size() - 1)];
+}
+
+int main(int argc, char **argv) try {
+	// Default arguments
+	int total = 1000;
+	int concurrency = 64;
+	std::string url = "http://localhost:8080/offer";
+
+	// Parse arguments
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (!arg.empty() && arg[0] == '-') {
+			std::string option = arg.substr(1);
+			if (option == "h") {
+				std::cout
+				    << "Usage: " << argv[0] << "[URL|<options>]\n"
+				    << "Options:\n"
+				    << "\t-h,\t\tShow this help message\n"
+				    << "\t-n NUMBER\tSpecify the total number of offers (default 1000)\n"
+				    << "\t-c NUMBER\tSpecify the number of offers in flight (default 64)\n"
+				    << "\t-s URL\t\tSpecify the server URL (default http://localhost:8080/offer)\n"
+				    << std::endl;
+				return 0;
+			} else if (option == "n") {
+				if (i + 1 == argc)
+					throw std::invalid_argument("Missing argument for option \"n\"");
+				total = std::atoi(argv[++i]);
+			} else if (option == "c") {
+				if (i + 1 == argc)
+					throw std::invalid_argument("Missing argument for option \"c\"");
+				concurrency = std::atoi(argv[++i]);
+			} else if (option == "s") {
+				if (i + 1 == argc)
+					throw std::invalid_argument("Missing argument for option \"s\"");
+				url = argv[++i];
+			} else {
+				throw std::invalid_argument("Unknown option \"" + option + "\"");
+			}
+		} else {
+			if (i > 1)
+				throw std::invalid_argument("Unexpected positional argument \"" + arg + "\"");
+			url = std::move(arg);
+		}
+	}
+
+	if (total <= 0 || concurrency <= 0)
+		throw std::invalid_argument("Invalid number of offers");
+
+	const size_t separator = url.find_last_of('/');
+	if (separator == std::string::npos)
+		throw std::invalid_argument("Invalid URL");
+
+	const std::string server = url.substr(0, separator);
+	const std::string path = url.substr(separator);
+
+	rtc::InitLogger(rtc::LogLevel::Warning);
+
+	const std::string offer = gatherOffer();
+
+	std::atomic<int> next = 0;
+	std::atomic<int> failed = 0;
+	std::mutex mutex;
+	std::vector<double> latencies; // milliseconds
+	latencies.reserve(total);
+
+	auto worker = [&]() {
+		http::Client cl(server.c_str());
+		cl.set_read_timeout(30s);
+		std::vector<double> local;
+		while (next++ < total) {
+			auto start = clock_type::now();
+			auto res = cl.Post(path.c_str(), offer, "application/json");
+			auto elapsed = std::chrono::duration<double, std::milli>(clock_type::now() - start);
+			if (res && res->status == 200)
+				local.push_back(elapsed.count());
+			else
+				++failed;
+		}
+		std::lock_guard lock(mutex);
+		latencies.insert(latencies.end(), local.begin(), local.end());
+	};
+
+	std::cout << "Sending " << total << " offers to " << url << " with " << concurrency
+	          << " in flight..." << std::endl;
+
+	auto start = clock_type::now();
+	std::vector<std::thread> threads;
+	for (int i = 0; i < std::min(concurrency, total); ++i)
+		threads.emplace_back(worker);
+
+	for (auto &t : threads)
+		t.join();
+
+	auto elapsed = std::chrono::duration<double>(clock_type::now() - start).count();
+
+	std::sort(latencies.begin(), latencies.end());
+
+	std::cout << std::fixed << std::setprecision(2);
+	std::cout << "Answers:    " << latencies.size() << " ok, " << failed << " failed\n"
+	          << "Throughput: " << double(latencies.size()) / elapsed << " offers/s\n"
+	          << "Latency:    p50 " << percentile(latencies, 0.50) << " ms, p99 "
+	          << percentile(latencies, 0.99) << " ms, max "
+	          << (latencies.empty() ? 0. : latencies.back()) << " ms" << std::endl;
+
+	return failed == 0 ? 0 : -1;
+
+} catch (const std::exception &e) {
+	std::cerr << "Error: " << e.what() << std::endl;
+	return -1;
+}
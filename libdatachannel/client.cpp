@@ -20,19 +20,37 @@
 #include <nlohmann/json.hpp>
 #include <rtc/rtc.hpp>
 
+#include <rtc/rtp.hpp>
+
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
 #include <future>
+#include <iomanip>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <random>
 #include <string>
+#include <thread>
 #include <vector>
 
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
 namespace http = httplib;
 using json = nlohmann::json;
 
 using namespace std::chrono_literals;
+using clock_type = std::chrono::steady_clock;
 
 std::string randomString(std::size_t length) {
 	static const std::string chars = "0123456789abcdefghijklmnopqrstuvwxyz";
@@ -43,10 +61,702 @@ std::string randomString(std::size_t length) {
 	return result;
 }
 
+double percentile(const std::vector<double> &sorted, double p) {
+	if (sorted.empty())
+		return 0.;
+
+	auto index = std::size_t(p * double(sorted.size() - 1) + 0.5);
+	return sorted[std::min(index, sorted.size() - 1)];
+}
+
+struct BenchmarkParams {
+	std::size_t size = 1024;
+	int count = 1000;
+	int window = 16;
+	bool unordered = false;
+	std::optional<unsigned int> maxRetransmits; // reliable if unset
+	bool json = false;
+};
+
+// DataChannel benchmark
+// Sends count binary messages of the given size with at most window of them
+// waiting for their echo. Each message starts with its index so the round trip
+// time can be measured on reception. With partial reliability, messages whose
+// echo does not come back within LossTimeout are counted as lost.
+class DataChannelBenchmark {
+public:
+	static constexpr auto LossTimeout = 1s;
+	static constexpr auto StallTimeout = 10s;
+
+	DataChannelBenchmark(std::shared_ptr<rtc::DataChannel> dc, BenchmarkParams params);
+
+	void start();
+	void receive(const rtc::binary &message);
+	void wait();
+	void report(std::ostream &out);
+
+private:
+	void sendMore(); // mMutex must be held
+
+	std::shared_ptr<rtc::DataChannel> mDataChannel;
+	const BenchmarkParams mParams;
+
+	std::mutex mMutex;
+	std::condition_variable mCondition;
+	std::vector<clock_type::time_point> mSendTimes; // reset once the echo is received or lost
+	std::vector<double> mLatencies;                 // milliseconds
+	int mSent = 0;
+	int mInFlight = 0;
+	int mLost = 0;
+	clock_type::time_point mStart;
+	clock_type::time_point mEnd;
+	clock_type::time_point mLastProgress;
+};
+
+DataChannelBenchmark::DataChannelBenchmark(std::shared_ptr<rtc::DataChannel> dc,
+                                           BenchmarkParams params)
+    : mDataChannel(std::move(dc)), mParams(std::move(params)) {
+	if (mParams.size < sizeof(uint32_t))
+		throw std::invalid_argument("Message size must be at least 4 bytes");
+
+	mSendTimes.resize(mParams.count);
+	mLatencies.reserve(mParams.count);
+}
+
+void DataChannelBenchmark::start() {
+	std::lock_guard lock(mMutex);
+	mStart = mLastProgress = clock_type::now();
+	sendMore();
+}
+
+void DataChannelBenchmark::receive(const rtc::binary &message) {
+	const auto now = clock_type::now();
+	if (message.size() != mParams.size)
+		return;
+
+	uint32_t index;
+	std::memcpy(&index, message.data(), sizeof(index));
+
+	std::lock_guard lock(mMutex);
+	if (index >= mSendTimes.size() || mSendTimes[index] == clock_type::time_point{})
+		return; // unknown, duplicate or already counted as lost
+
+	mLatencies.push_back(std::chrono::duration<double, std::milli>(now - mSendTimes[index]).count());
+	mSendTimes[index] = clock_type::time_point{};
+	mLastProgress = now;
+	--mInFlight;
+
+	sendMore();
+
+	if (mInFlight == 0 && mSent == mParams.count) {
+		mEnd = now;
+		mCondition.notify_all();
+	}
+}
+
+void DataChannelBenchmark::sendMore() {
+	rtc::binary message(mParams.size);
+	while (mInFlight < mParams.window && mSent < mParams.count) {
+		const uint32_t index = uint32_t(mSent++);
+		std::memcpy(message.data(), &index, sizeof(index));
+		mSendTimes[index] = clock_type::now();
+		++mInFlight;
+		mDataChannel->send(message.data(), message.size());
+	}
+}
+
+void DataChannelBenchmark::wait() {
+	std::unique_lock lock(mMutex);
+	while (mInFlight > 0 || mSent < mParams.count) {
+		const bool reliable = !mParams.maxRetransmits;
+		const auto timeout = reliable ? StallTimeout : LossTimeout;
+		if (mCondition.wait_until(lock, mLastProgress + timeout) != std::cv_status::timeout)
+			continue;
+
+		if (clock_type::now() < mLastProgress + timeout)
+			continue;
+
+		if (reliable)
+			throw std::runtime_error("Timeout waiting for echoed messages");
+
+		// Count outstanding messages as lost and carry on
+		for (auto &t : mSendTimes)
+			if (t != clock_type::time_point{}) {
+				t = clock_type::time_point{};
+				++mLost;
+			}
+
+		mInFlight = 0;
+		mLastProgress = mEnd = clock_type::now();
+		sendMore();
+	}
+}
+
+void DataChannelBenchmark::report(std::ostream &out) {
+	std::lock_guard lock(mMutex);
+	std::sort(mLatencies.begin(), mLatencies.end());
+
+	const double elapsed = std::chrono::duration<double>(mEnd - mStart).count();
+	const double bytes = double(mLatencies.size()) * double(mParams.size);
+	const double throughput = elapsed > 0. ? bytes / elapsed / 1e6 : 0.;
+	const double max = mLatencies.empty() ? 0. : mLatencies.back();
+
+	if (mParams.json) {
+		json result;
+		result["size"] = mParams.size;
+		result["count"] = mParams.count;
+		result["window"] = mParams.window;
+		result["ordered"] = !mParams.unordered;
+		if (mParams.maxRetransmits)
+			result["maxRetransmits"] = *mParams.maxRetransmits;
+		result["received"] = mLatencies.size();
+		result["lost"] = mLost;
+		result["elapsed"] = elapsed;
+		result["throughput"] = throughput;
+		result["latency"] = {{"p50", percentile(mLatencies, 0.50)},
+		                     {"p99", percentile(mLatencies, 0.99)},
+		                     {"p999", percentile(mLatencies, 0.999)},
+		                     {"max", max}};
+		out << result.dump() << std::endl;
+		return;
+	}
+
+	out << std::fixed << std::setprecision(2);
+	out << "Messages:   " << mLatencies.size() << " echoed, " << mLost << " lost ("
+	    << mParams.size << " bytes, window " << mParams.window << ")\n"
+	    << "Throughput: " << throughput << " MB/s\n"
+	    << "Latency:    p50 " << percentile(mLatencies, 0.50) << " ms, p99 "
+	    << percentile(mLatencies, 0.99) << " ms, p999 " << percentile(mLatencies, 0.999)
+	    << " ms, max " << max << " ms" << std::endl;
+}
+
+struct MediaParams {
+	int bitrate = 0; // kbit/s, 0 only waits for the track to open
+	int fps = 30;
+	std::chrono::seconds duration = 10s;
+	std::size_t mtu = 1200; // maximum RTP packet size
+	bool json = false;
+};
+
+// Synthetic VP8 media test
+// Sends frames of the configured size at the frame rate, packetized as VP8 RTP
+// (RFC 7741) with the minimal one byte payload descriptor. The payload is not
+// decodable: each packet carries a probe with its index and send time instead,
+// which is read back from the echo to measure loss, reordering, RTT and the
+// RFC 3550 interarrival jitter.
+class MediaTest {
+public:
+	static constexpr uint8_t PayloadType = 96;
+	static constexpr uint32_t ClockRate = 90000;
+	static constexpr auto DrainTime = 1s;
+
+	MediaTest(std::shared_ptr<rtc::Track> track, uint32_t ssrc, MediaParams params);
+
+	void run();
+	void receive(const rtc::binary &packet);
+	void report(std::ostream &out);
+
+private:
+#pragma pack(push, 1)
+	struct Probe {
+		uint32_t index;
+		int64_t sendTime; // microseconds since the test started
+	};
+#pragma pack(pop)
+
+	static constexpr std::size_t HeaderSize = sizeof(rtc::RtpHeader) + 1;
+
+	int64_t now() const;
+	void sendFrame(uint32_t timestamp);
+
+	std::shared_ptr<rtc::Track> mTrack;
+	const uint32_t mSsrc;
+	const MediaParams mParams;
+	const clock_type::time_point mStart;
+	uint16_t mSeqNumber = 0;
+	std::atomic<uint32_t> mSent = 0;
+	uint64_t mSentBytes = 0;
+
+	std::mutex mMutex;
+	std::vector<bool> mReceived;
+	uint32_t mHighest = 0;
+	uint64_t mReceivedCount = 0;
+	uint64_t mReordered = 0;
+	uint64_t mDuplicates = 0;
+	std::vector<double> mRtts; // milliseconds
+	double mJitter = 0.;       // RTP timestamp units
+	std::optional<int64_t> mLastTransit;
+};
+
+MediaTest::MediaTest(std::shared_ptr<rtc::Track> track, uint32_t ssrc, MediaParams params)
+    : mTrack(std::move(track)), mSsrc(ssrc), mParams(std::move(params)),
+      mStart(clock_type::now()) {
+	if (mParams.fps <= 0 || mParams.mtu < HeaderSize + sizeof(Probe))
+		throw std::invalid_argument("Invalid media parameters");
+}
+
+int64_t MediaTest::now() const {
+	return std::chrono::duration_cast<std::chrono::microseconds>(clock_type::now() - mStart)
+	    .count();
+}
+
+void MediaTest::run() {
+	const auto interval = std::chrono::duration<double>(1. / mParams.fps);
+	const auto frames = int64_t(mParams.duration.count()) * mParams.fps;
+	const auto start = clock_type::now();
+	for (int64_t i = 0; i < frames; ++i) {
+		std::this_thread::sleep_until(
+		    start + std::chrono::duration_cast<clock_type::duration>(interval * i));
+		sendFrame(uint32_t(i * ClockRate / mParams.fps));
+	}
+
+	std::this_thread::sleep_for(DrainTime);
+}
+
+void MediaTest::sendFrame(uint32_t timestamp) {
+	const std::size_t frameSize =
+	    std::max(std::size_t(mParams.bitrate) * 1000 / 8 / std::size_t(mParams.fps), sizeof(Probe));
+	const std::size_t maxPayload = mParams.mtu - HeaderSize;
+	std::size_t remaining = frameSize;
+	bool first = true;
+
+	rtc::binary packet;
+	while (remaining > 0) {
+		std::size_t payloadSize = std::min(remaining, maxPayload);
+		if (remaining - payloadSize > 0 && remaining - payloadSize < sizeof(Probe))
+			payloadSize = remaining - sizeof(Probe); // leave room for the last probe
+		remaining -= payloadSize;
+
+		packet.assign(HeaderSize + payloadSize, std::byte(0));
+		auto header = reinterpret_cast<rtc::RtpHeader *>(packet.data());
+		header->preparePacket();
+		header->setPayloadType(PayloadType);
+		header->setSsrc(mSsrc);
+		header->setTimestamp(timestamp);
+		header->setSeqNumber(mSeqNumber++);
+		header->setMarker(remaining == 0);
+
+		// VP8 payload descriptor, S bit on the first packet of the frame
+		packet[sizeof(rtc::RtpHeader)] = first ? std::byte(0x10) : std::byte(0x00);
+		first = false;
+
+		Probe probe{mSent++, now()};
+		std::memcpy(packet.data() + HeaderSize, &probe, sizeof(probe));
+
+		mSentBytes += packet.size();
+		mTrack->send(packet.data(), packet.size());
+	}
+}
+
+void MediaTest::receive(const rtc::binary &packet) {
+	const int64_t arrival = now();
+	if (packet.size() < HeaderSize + sizeof(Probe))
+		return;
+
+	// Ignore RTCP, packet types 192-223 share the second byte with the payload type
+	const auto type = std::to_integer<uint8_t>(packet[1]);
+	if (type >= 192 && type <= 223)
+		return;
+
+	auto header = reinterpret_cast<const rtc::RtpHeader *>(packet.data());
+	const std::size_t offset = header->getBody() - reinterpret_cast<const char *>(packet.data());
+	if (packet.size() < offset + 1 + sizeof(Probe))
+		return;
+
+	Probe probe;
+	std::memcpy(&probe, packet.data() + offset + 1, sizeof(probe));
+
+	std::lock_guard lock(mMutex);
+	if (probe.index >= mSent)
+		return; // not one of ours
+
+	if (mReceived.size() <= probe.index)
+		mReceived.resize(probe.index + 1, false);
+
+	if (mReceived[probe.index]) {
+		++mDuplicates;
+		return;
+	}
+
+	mReceived[probe.index] = true;
+	++mReceivedCount;
+
+	if (mReceivedCount > 1 && probe.index < mHighest)
+		++mReordered;
+	else
+		mHighest = probe.index;
+
+	mRtts.push_back(double(arrival - probe.sendTime) / 1e3);
+
+	// RFC 3550 A.8 interarrival jitter, with the arrival time in RTP timestamp units
+	const int64_t transit = arrival * ClockRate / 1000000 - int64_t(header->timestamp());
+	if (mLastTransit) {
+		const double d = std::abs(double(transit - *mLastTransit));
+		mJitter += (d - mJitter) / 16.;
+	}
+	mLastTransit = transit;
+}
+
+void MediaTest::report(std::ostream &out) {
+	std::lock_guard lock(mMutex);
+	std::sort(mRtts.begin(), mRtts.end());
+
+	const uint32_t sent = mSent;
+	const uint64_t lost = sent - mReceivedCount;
+	const double loss = sent > 0 ? double(lost) / double(sent) : 0.;
+	const double jitter = mJitter * 1000. / ClockRate; // milliseconds
+	const double seconds = double(mParams.duration.count());
+	const double sentBitrate = seconds > 0. ? double(mSentBytes) * 8. / seconds / 1e3 : 0.;
+	const double max = mRtts.empty() ? 0. : mRtts.back();
+
+	if (mParams.json) {
+		json result;
+		result["bitrate"] = mParams.bitrate;
+		result["fps"] = mParams.fps;
+		result["sentBitrate"] = sentBitrate;
+		result["sent"] = sent;
+		result["received"] = mReceivedCount;
+		result["lost"] = lost;
+		result["loss"] = loss;
+		result["reordered"] = mReordered;
+		result["duplicates"] = mDuplicates;
+		result["jitter"] = jitter;
+		result["rtt"] = {{"p50", percentile(mRtts, 0.50)},
+		                 {"p99", percentile(mRtts, 0.99)},
+		                 {"max", max}};
+		out << result.dump() << std::endl;
+		return;
+	}
+
+	out << std::fixed << std::setprecision(2);
+	out << "Packets:    " << sent << " sent (" << sentBitrate << " kbit/s), " << mReceivedCount
+	    << " echoed, " << lost << " lost (" << loss * 100. << "%), " << mReordered
+	    << " reordered, " << mDuplicates << " duplicates\n"
+	    << "Jitter:     " << jitter << " ms\n"
+	    << "RTT:        p50 " << percentile(mRtts, 0.50) << " ms, p99 " << percentile(mRtts, 0.99)
+	    << " ms, max " << max << " ms" << std::endl;
+}
+
+struct LoadParams {
+	int sessions = 100;
+	double rate = 10.;               // new sessions per second
+	std::chrono::seconds hold = 10s; // time the sessions are kept open after the ramp
+	int httpThreads = 8;
+	bool json = false;
+};
+
+// Multi-session load test
+// Opens sessions peer connections at the ramp rate from one process, each with a
+// DataChannel that sends one probe to be echoed, then holds them open. Offers are
+// posted by a small pool of HTTP threads so that blocking requests never run on
+// the libdatachannel threads. Setup time is split per phase from the timestamps
+// below, which stay unset for phases a session never reached.
+class LoadTest {
+public:
+	LoadTest(std::string server, std::string path, LoadParams params);
+	~LoadTest();
+
+	void run();
+	void report(std::ostream &out);
+	bool succeeded();
+
+private:
+	struct Session {
+		std::shared_ptr<rtc::PeerConnection> pc;
+		std::shared_ptr<rtc::DataChannel> dc;
+		std::string probe;
+		clock_type::time_point created, gathered, answered, iceConnected, connected, opened,
+		    echoed;
+		bool failed = false;
+	};
+
+	void startSession();
+	void postOffer(std::weak_ptr<Session> weakSession, std::string offer);
+	void runHttp();
+	void setTime(const std::weak_ptr<Session> &weakSession, clock_type::time_point Session::*t);
+	void fail(const std::weak_ptr<Session> &weakSession);
+
+	const std::string mServer;
+	const std::string mPath;
+	const LoadParams mParams;
+
+	std::mutex mMutex;
+	std::vector<std::shared_ptr<Session>> mSessions;
+	double mElapsed = 0.;
+
+	std::mutex mQueueMutex;
+	std::condition_variable mQueueCondition;
+	std::deque<std::pair<std::weak_ptr<Session>, std::string>> mQueue;
+	bool mStopped = false;
+	std::vector<std::thread> mHttpThreads;
+};
+
+LoadTest::LoadTest(std::string server, std::string path, LoadParams params)
+    : mServer(std::move(server)), mPath(std::move(path)), mParams(std::move(params)) {
+	mSessions.reserve(mParams.sessions);
+	for (int i = 0; i < mParams.httpThreads; ++i)
+		mHttpThreads.emplace_back([this]() { runHttp(); });
+}
+
+LoadTest::~LoadTest() {
+	{
+		std::lock_guard lock(mQueueMutex);
+		mStopped = true;
+	}
+	mQueueCondition.notify_all();
+	for (auto &t : mHttpThreads)
+		t.join();
+
+	// The callbacks capture this, so they are reset before the connections are closed.
+	// Setting a callback waits for a call already running on a libdatachannel thread,
+	// and none is made once it is reset.
+	for (auto &session : mSessions) {
+		session->dc->onOpen(nullptr);
+		session->dc->onMessage(nullptr);
+		session->pc->onGatheringStateChange(nullptr);
+		session->pc->onIceStateChange(nullptr);
+		session->pc->onStateChange(nullptr);
+		session->pc->close();
+	}
+}
+
+void LoadTest::run() {
+	const auto start = clock_type::now();
+	const auto interval = std::chrono::duration<double>(1. / mParams.rate);
+	for (int i = 0; i < mParams.sessions; ++i) {
+		std::this_thread::sleep_until(
+		    start + std::chrono::duration_cast<clock_type::duration>(interval * i));
+		startSession();
+	}
+
+	std::this_thread::sleep_for(mParams.hold);
+	mElapsed = std::chrono::duration<double>(clock_type::now() - start).count();
+}
+
+void LoadTest::startSession() {
+	auto session = std::make_shared<Session>();
+	session->probe = randomString(16);
+
+	rtc::Configuration config;
+	config.disableAutoNegotiation = true;
+	auto pc = std::make_shared<rtc::PeerConnection>(std::move(config));
+	std::weak_ptr<Session> weakSession = session;
+	std::weak_ptr<rtc::PeerConnection> weakPc = pc;
+
+	pc->onGatheringStateChange(
+	    [this, weakSession, weakPc](rtc::PeerConnection::GatheringState state) {
+		    auto pc = weakPc.lock();
+		    if (!pc || state != rtc::PeerConnection::GatheringState::Complete)
+			    return;
+
+		    setTime(weakSession, &Session::gathered);
+		    auto local = pc->localDescription().value();
+		    json msg;
+		    msg["sdp"] = std::string(local);
+		    msg["type"] = local.typeString();
+		    postOffer(weakSession, msg.dump());
+	    });
+
+	pc->onIceStateChange([this, weakSession](rtc::PeerConnection::IceState state) {
+		if (state == rtc::PeerConnection::IceState::Connected ||
+		    state == rtc::PeerConnection::IceState::Completed)
+			setTime(weakSession, &Session::iceConnected);
+	});
+
+	pc->onStateChange([this, weakSession](rtc::PeerConnection::State state) {
+		if (state == rtc::PeerConnection::State::Connected)
+			setTime(weakSession, &Session::connected);
+		else if (state == rtc::PeerConnection::State::Disconnected ||
+		         state == rtc::PeerConnection::State::Failed)
+			fail(weakSession);
+	});
+
+	auto dc = pc->createDataChannel("echo");
+	std::weak_ptr<rtc::DataChannel> weakDc = dc;
+	const std::string probe = session->probe;
+
+	dc->onOpen([this, weakSession, weakDc, probe]() {
+		setTime(weakSession, &Session::opened);
+		if (auto dc = weakDc.lock())
+			dc->send(probe);
+	});
+
+	dc->onMessage([this, weakSession, probe](auto message) {
+		if (std::holds_alternative<std::string>(message) && std::get<std::string>(message) == probe)
+			setTime(weakSession, &Session::echoed);
+	});
+
+	session->pc = pc;
+	session->dc = dc;
+	{
+		std::lock_guard lock(mMutex);
+		session->created = clock_type::now();
+		mSessions.push_back(session);
+	}
+
+	pc->setLocalDescription(rtc::Description::Type::Offer);
+}
+
+void LoadTest::postOffer(std::weak_ptr<Session> weakSession, std::string offer) {
+	{
+		std::lock_guard lock(mQueueMutex);
+		mQueue.emplace_back(std::move(weakSession), std::move(offer));
+	}
+	mQueueCondition.notify_one();
+}
+
+void LoadTest::runHttp() {
+	http::Client cl(mServer.c_str());
+	cl.set_read_timeout(30s);
+	while (true) {
+		std::unique_lock lock(mQueueMutex);
+		mQueueCondition.wait(lock, [this]() { return mStopped || !mQueue.empty(); });
+		if (mStopped)
+			return;
+
+		auto [weakSession, offer] = std::move(mQueue.front());
+		mQueue.pop_front();
+		lock.unlock();
+
+		auto session = weakSession.lock();
+		if (!session)
+			continue;
+
+		try {
+			auto res = cl.Post(mPath.c_str(), offer, "application/json");
+			if (!res || res->status != 200)
+				throw std::runtime_error("HTTP request failed");
+
+			auto parsed = json::parse(res->body);
+			rtc::Description remote(parsed["sdp"].get<std::string>(),
+			                        parsed["type"].get<std::string>());
+			setTime(weakSession, &Session::answered);
+			session->pc->setRemoteDescription(std::move(remote));
+
+		} catch (const std::exception &) {
+			fail(weakSession);
+		}
+	}
+}
+
+void LoadTest::setTime(const std::weak_ptr<Session> &weakSession,
+                       clock_type::time_point Session::*t) {
+	if (auto session = weakSession.lock()) {
+		std::lock_guard lock(mMutex);
+		if ((*session).*t == clock_type::time_point{})
+			(*session).*t = clock_type::now();
+	}
+}
+
+void LoadTest::fail(const std::weak_ptr<Session> &weakSession) {
+	if (auto session = weakSession.lock()) {
+		std::lock_guard lock(mMutex);
+		session->failed = true;
+	}
+}
+
+bool LoadTest::succeeded() {
+	std::lock_guard lock(mMutex);
+	return std::all_of(mSessions.begin(), mSessions.end(), [](const auto &session) {
+		return !session->failed && session->echoed != clock_type::time_point{};
+	});
+}
+
+void LoadTest::report(std::ostream &out) {
+	struct Phase {
+		const char *name;
+		clock_type::time_point Session::*from;
+		clock_type::time_point Session::*to;
+		std::vector<double> durations; // milliseconds
+	};
+
+	std::vector<Phase> phases = {
+	    {"gather", &Session::created, &Session::gathered, {}},
+	    {"http", &Session::gathered, &Session::answered, {}},
+	    {"ice", &Session::answered, &Session::iceConnected, {}},
+	    {"dtls", &Session::iceConnected, &Session::connected, {}},
+	    {"sctp", &Session::connected, &Session::opened, {}},
+	    {"echo", &Session::opened, &Session::echoed, {}},
+	    {"total", &Session::created, &Session::echoed, {}},
+	};
+
+	std::size_t sessions = 0;
+	int established = 0;
+	int failed = 0;
+	{
+		std::lock_guard lock(mMutex);
+		sessions = mSessions.size();
+		for (const auto &session : mSessions) {
+			if (session->echoed != clock_type::time_point{})
+				++established;
+			if (session->failed)
+				++failed;
+
+			for (auto &phase : phases) {
+				const auto from = (*session).*phase.from;
+				const auto to = (*session).*phase.to;
+				if (from != clock_type::time_point{} && to != clock_type::time_point{})
+					phase.durations.push_back(
+					    std::chrono::duration<double, std::milli>(to - from).count());
+			}
+		}
+	}
+
+	for (auto &phase : phases)
+		std::sort(phase.durations.begin(), phase.durations.end());
+
+	double cpu = 0.;
+	long maxRss = 0; // KiB
+#ifndef _WIN32
+	struct rusage usage = {};
+	if (getrusage(RUSAGE_SELF, &usage) == 0) {
+		cpu = double(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+		      double(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+		maxRss = usage.ru_maxrss;
+	}
+#endif
+
+	const double successRate = sessions > 0 ? double(established) / double(sessions) : 0.;
+
+	if (mParams.json) {
+		json result;
+		result["sessions"] = sessions;
+		result["established"] = established;
+		result["failed"] = failed;
+		result["successRate"] = successRate;
+		result["elapsed"] = mElapsed;
+		result["cpu"] = cpu;
+		result["maxRss"] = maxRss;
+		for (const auto &phase : phases)
+			result["phases"][phase.name] = {
+			    {"count", phase.durations.size()},
+			    {"p50", percentile(phase.durations, 0.50)},
+			    {"p99", percentile(phase.durations, 0.99)},
+			    {"max", phase.durations.empty() ? 0. : phase.durations.back()}};
+		out << result.dump() << std::endl;
+		return;
+	}
+
+	out << std::fixed << std::setprecision(2);
+	out << "Sessions:   " << sessions << " started, " << established << " echoed, " << failed
+	    << " failed (" << successRate * 100. << "% success)\n"
+	    << "Resources:  " << cpu << " s CPU in " << mElapsed << " s, max RSS " << maxRss / 1024
+	    << " MiB\n";
+	for (const auto &phase : phases)
+		out << "Phase " << std::left << std::setw(7) << phase.name << std::right << "p50 "
+		    << percentile(phase.durations, 0.50) << " ms, p99 "
+		    << percentile(phase.durations, 0.99) << " ms, max "
+		    << (phase.durations.empty() ? 0. : phase.durations.back()) << " ms\n";
+	out << std::flush;
+}
+
 int main(int argc, char **argv) try {
 	// Default arguments
 	int test = 0;
 	std::string url = "http://localhost:8080/offer";
+	BenchmarkParams params;
+	LoadParams loadParams;
+	MediaParams mediaParams;
 
 	// Parse arguments
 	for (int i = 1; i < argc; ++i) {
@@ -60,6 +770,21 @@ int main(int argc, char **argv) try {
 				    << "\t-h,\t\tShow this help message\n"
 				    << "\t-t NUMBER\tSpecify the test number (default 0)\n"
 				    << "\t-s URL\t\tSpecify the server URL (default http://localhost:8080/offer)\n"
+				    << "Media options (test 0):\n"
+				    << "\t-b KBPS\t\tSend synthetic VP8 at this bitrate, 0 to only open the track (default 0)\n"
+				    << "\t-f FPS\t\tSpecify the frame rate (default 30)\n"
+				    << "\t-d SECONDS\tSpecify the media duration (default 10)\n"
+				    << "Benchmark options (test 2):\n"
+				    << "\t-m SIZE\t\tSpecify the message size in bytes (default 1024)\n"
+				    << "\t-n NUMBER\tSpecify the number of messages (default 1000)\n"
+				    << "\t-w NUMBER\tSpecify the number of messages in flight (default 16)\n"
+				    << "\t-u,\t\tUse an unordered DataChannel\n"
+				    << "\t-r NUMBER\tSpecify the max retransmits for partial reliability\n"
+				    << "Load test options (test 3):\n"
+				    << "\t-c NUMBER\tSpecify the number of sessions (default 100)\n"
+				    << "\t-a RATE\t\tSpecify the new sessions per second (default 10)\n"
+				    << "\t-d SECONDS\tSpecify the hold time after the ramp (default 10)\n"
+				    << "\t-j,\t\tPrint the results as JSON (tests 0, 2 and 3)\n"
 				    << std::endl;
 				return 0;
 			} else if (option == "t") {
@@ -70,6 +795,46 @@ int main(int argc, char **argv) try {
 				if (i + 1 == argc)
 					throw std::invalid_argument("Missing argument for option \"s\"");
 				url = argv[++i];
+			} else if (option == "b") {
+				if (i + 1 == argc)
+					throw std::invalid_argument("Missing argument for option \"b\"");
+				mediaParams.bitrate = std::atoi(argv[++i]);
+			} else if (option == "f") {
+				if (i + 1 == argc)
+					throw std::invalid_argument("Missing argument for option \"f\"");
+				mediaParams.fps = std::atoi(argv[++i]);
+			} else if (option == "m") {
+				if (i + 1 == argc)
+					throw std::invalid_argument("Missing argument for option \"m\"");
+				params.size = std::size_t(std::atol(argv[++i]));
+			} else if (option == "n") {
+				if (i + 1 == argc)
+					throw std::invalid_argument("Missing argument for option \"n\"");
+				params.count = std::atoi(argv[++i]);
+			} else if (option == "w") {
+				if (i + 1 == argc)
+					throw std::invalid_argument("Missing argument for option \"w\"");
+				params.window = std::atoi(argv[++i]);
+			} else if (option == "u") {
+				params.unordered = true;
+			} else if (option == "r") {
+				if (i + 1 == argc)
+					throw std::invalid_argument("Missing argument for option \"r\"");
+				params.maxRetransmits = unsigned(std::atoi(argv[++i]));
+			} else if (option == "c") {
+				if (i + 1 == argc)
+					throw std::invalid_argument("Missing argument for option \"c\"");
+				loadParams.sessions = std::atoi(argv[++i]);
+			} else if (option == "a") {
+				if (i + 1 == argc)
+					throw std::invalid_argument("Missing argument for option \"a\"");
+				loadParams.rate = std::atof(argv[++i]);
+			} else if (option == "d") {
+				if (i + 1 == argc)
+					throw std::invalid_argument("Missing argument for option \"d\"");
+				loadParams.hold = mediaParams.duration = std::chrono::seconds(std::atoi(argv[++i]));
+			} else if (option == "j") {
+				params.json = loadParams.json = mediaParams.json = true;
 			} else {
 				throw std::invalid_argument("Unknown option \"" + option + "\"");
 			}
@@ -80,9 +845,15 @@ int main(int argc, char **argv) try {
 		}
 	}
 
-	if (test != 0 && test != 1)
+	if (test < 0 || test > 3)
 		throw std::invalid_argument("Invalid test number");
 
+	if (loadParams.sessions <= 0 || loadParams.rate <= 0.)
+		throw std::invalid_argument("Invalid number of sessions");
+
+	if (params.count <= 0 || params.window <= 0)
+		throw std::invalid_argument("Invalid number of messages");
+
 	const size_t separator = url.find_last_of('/');
 	if (separator == std::string::npos)
 		throw std::invalid_argument("Invalid URL");
@@ -90,6 +861,14 @@ int main(int argc, char **argv) try {
 	const std::string server = url.substr(0, separator);
 	const std::string path = url.substr(separator);
 
+	if (test == 3) { // Load test
+		rtc::InitLogger(rtc::LogLevel::Error);
+		LoadTest load(server, path, loadParams);
+		load.run();
+		load.report(std::cout);
+		return load.succeeded() ? 0 : -1;
+	}
+
 	std::promise<void> promise;
 	auto future = promise.get_future();
 
@@ -100,6 +879,8 @@ int main(int argc, char **argv) try {
 	// Set up Peer Connection
 	rtc::Configuration config;
 	config.disableAutoNegotiation = true;
+	if (test == 2)
+		config.maxMessageSize = std::max(params.size, std::size_t(256 * 1024));
 	rtc::PeerConnection pc{std::move(config)};
 
 	pc.onGatheringStateChange([url, path, &pc, &cl,
@@ -149,14 +930,37 @@ int main(int argc, char **argv) try {
 
 	std::shared_ptr<rtc::Track> tr;
 	std::shared_ptr<rtc::DataChannel> dc;
+	std::unique_ptr<DataChannelBenchmark> benchmark;
+	std::unique_ptr<MediaTest> mediaTest;
 	if (test == 0) { // Peer Connection test
 		rtc::Description::Video media("echo", rtc::Description::Direction::SendRecv);
-		media.addVP8Codec(96);
-		tr = pc.addTrack(std::move(media));
+		media.addVP8Codec(MediaTest::PayloadType);
+
+		if (mediaParams.bitrate > 0) {
+			const auto ssrc = uint32_t(std::random_device{}());
+			media.addSSRC(ssrc, "video-send");
+			tr = pc.addTrack(std::move(media));
+			mediaTest = std::make_unique<MediaTest>(tr, ssrc, mediaParams);
+			tr->onMessage([&mediaTest](rtc::binary packet) { mediaTest->receive(packet); },
+			              [](rtc::string) {});
+		} else {
+			tr = pc.addTrack(std::move(media));
+		}
 
-		// TODO: send media
 		tr->onOpen([&promise]() { promise.set_value(); });
 
+	} else if (test == 2) { // Data Channel benchmark
+		rtc::DataChannelInit init;
+		init.reliability.unordered = params.unordered;
+		init.reliability.maxRetransmits = params.maxRetransmits;
+		dc = pc.createDataChannel("benchmark", std::move(init));
+		benchmark = std::make_unique<DataChannelBenchmark>(dc, params);
+
+		dc->onOpen([&promise]() { promise.set_value(); });
+
+		dc->onMessage([&benchmark](rtc::binary message) { benchmark->receive(message); },
+		              [](rtc::string) {});
+
 	} else { // test == 1 Data Channel test
 		auto test = randomString(5);
 		dc = pc.createDataChannel("echo");
@@ -186,6 +990,18 @@ int main(int argc, char **argv) try {
 		throw std::runtime_error("Timeout");
 
 	future.get();
+
+	if (mediaTest) {
+		mediaTest->run();
+		mediaTest->report(std::cout);
+	}
+
+	if (benchmark) {
+		benchmark->start();
+		benchmark->wait();
+		benchmark->report(std::cout);
+	}
+
 	return 0;
 
 } catch (const std::exception &e) {
@@ -16,80 +16,982 @@
  * along with this program; If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <httplib.h>
+#include <event2/buffer.h>
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/thread.h>
 #include <nlohmann/json.hpp>
 #include <rtc/rtc.hpp>
+#include <rtc/rtp.hpp>
 
+#include <atomic>
+#include <cerrno>
 #include <chrono>
-#include <string>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
 #include <future>
+#include <iomanip>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <variant>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <unistd.h>
+#endif
 
-namespace http = httplib;
 using json = nlohmann::json;
 
 using namespace std::chrono_literals;
 
-int main(int argc, char **argv) try {
-	const std::string host = "0.0.0.0";
-	const int port = argc > 1 ? std::atoi(argv[1]) :  8080;
+using clock_type = std::chrono::steady_clock;
 
-	rtc::InitLogger(rtc::LogLevel::Warning);
+// Smallest RTCP packet, e.g. a receiver report without report blocks
+const size_t RtcpHeaderSize = 8;
 
-	http::Server srv;
-	srv.Post("/offer", [](const httplib::Request &req, httplib::Response &res) {
-		auto parsed = json::parse(req.body);
-		rtc::Description remote(parsed["sdp"].get<std::string>(), parsed["type"].get<std::string>());
+// Maximum time an offer may wait for ICE gathering before the request is failed
+const auto GatheringTimeout = 10s;
 
-		auto pc = std::make_shared<rtc::PeerConnection>(rtc::Configuration{});
+// Echoed DataChannel messages stop being received above this amount of buffered data
+const size_t EchoBufferHighWatermark = 4 * 1024 * 1024;
 
-		std::promise<std::string> promise;
-		auto future = promise.get_future();
+// Local maximum message size announced in the answer when the DataChannel echo is enabled
+const size_t EchoMaxMessageSize = 16 * 1024 * 1024;
 
-		pc->onGatheringStateChange([pc, &promise](rtc::PeerConnection::GatheringState state) {
-			if (state == rtc::PeerConnection::GatheringState::Complete) {
-				try {
-					auto local = pc->localDescription().value();
-					json msg;
-					msg["sdp"] = std::string(local);
-					msg["type"] = local.typeString();
-					promise.set_value(msg.dump());
+// Maximum time to wait for the DTLS certificate at startup
+const auto CertificateTimeout = 30s;
 
-				} catch (...) {
-					promise.set_exception(std::current_exception());
-				}
+// Sessions that haven't connected this long after the offer are reaped
+const auto ConnectTimeout = 30s;
+
+// Interval between the reaper's checks for unconnected and idle sessions
+const auto ReapInterval = 1s;
+
+// UDP port shared by all connections with the ICE UDP mux if no port range is set
+const uint16_t DefaultMuxPort = 50000;
+
+struct Options {
+	bool rtpReflector = false;           // echo media with the RTP reflector instead of the track
+	bool dataChannelEcho = false;        // echo messages with the flow-controlled DataChannelEcho
+	std::chrono::seconds statsInterval = 5s; // 0 disables statistics
+
+	rtc::CertificateType certificateType = rtc::CertificateType::Default;
+	std::optional<std::string> certificateFile; // PEM certificate, generated if not set
+	std::optional<std::string> keyFile;         // PEM private key
+	std::chrono::seconds certificateReload = 0s; // 0 never reloads the PEM files
+	std::chrono::seconds idleTimeout = 0s;       // 0 never reaps idle sessions
+
+	bool udpMux = false;                    // share a single UDP port between all connections
+	std::optional<std::string> bindAddress; // local address for ICE, all addresses if not set
+	uint16_t portRangeBegin = 0;            // 0 for the default range, or DefaultMuxPort with udpMux
+	uint16_t portRangeEnd = 0;
+};
+
+// Counters updated from the libdatachannel threads and reported from the event loop
+struct Stats {
+	std::atomic<uint64_t> rtpPackets = 0;
+	std::atomic<uint64_t> rtcpPackets = 0;
+	std::atomic<uint64_t> mediaBytes = 0;
+	std::atomic<uint64_t> latencyTotal = 0; // nanoseconds
+	std::atomic<uint64_t> latencyMax = 0;   // nanoseconds
+	std::atomic<int> tracks = 0;
+
+	std::atomic<uint64_t> dcMessages = 0;
+	std::atomic<uint64_t> dcBytes = 0;
+	std::atomic<int64_t> dcBuffered = 0; // bytes currently buffered for sending
+	std::atomic<int> channels = 0;
+
+	void addLatency(uint64_t ns) {
+		latencyTotal += ns;
+		uint64_t max = latencyMax.load();
+		while (ns > max && !latencyMax.compare_exchange_weak(max, ns))
+			;
+	}
+};
+
+// RTP reflector
+// Sends each received packet straight back from the receive buffer, bypassing the
+// message variant copy of the generic echo. If the answer declares its own SSRC,
+// packets are rewritten to it. The remote may send several streams which end up
+// merged into one, so each source SSRC gets a fixed sequence number offset from its
+// first packet. Gaps and reordering within a stream are passed on unchanged.
+class RtpReflector {
+public:
+	RtpReflector(std::shared_ptr<rtc::Track> track, Stats *stats);
+	~RtpReflector();
+
+	void reflect(rtc::binary packet);
+
+private:
+	std::weak_ptr<rtc::Track> mTrack;
+	Stats *mStats;
+	std::optional<uint32_t> mSsrc;
+	std::unordered_map<uint32_t, uint16_t> mSeqOffsets; // by source SSRC
+	uint16_t mNextSeqNumber = 0; // one past the highest sequence number sent
+};
+
+RtpReflector::RtpReflector(std::shared_ptr<rtc::Track> track, Stats *stats)
+    : mTrack(track), mStats(stats) {
+	auto ssrcs = track->description().getSSRCs();
+	if (!ssrcs.empty())
+		mSsrc = ssrcs.front();
+
+	++mStats->tracks;
+}
+
+RtpReflector::~RtpReflector() { --mStats->tracks; }
+
+void RtpReflector::reflect(rtc::binary packet) {
+	const auto start = clock_type::now();
+
+	auto track = mTrack.lock();
+	if (!track || packet.size() < RtcpHeaderSize)
+		return;
+
+	// RTCP packet types 192-223 share the second byte with the RTP marker and payload type
+	const auto type = std::to_integer<uint8_t>(packet[1]);
+	const bool isRtcp = type >= 192 && type <= 223;
+	if (isRtcp) {
+		++mStats->rtcpPackets;
+	} else {
+		if (packet.size() < sizeof(rtc::RtpHeader))
+			return;
+
+		++mStats->rtpPackets;
+		if (mSsrc) {
+			auto header = reinterpret_cast<rtc::RtpHeader *>(packet.data());
+			const uint16_t seqNumber = header->seqNumber();
+			auto [it, inserted] = mSeqOffsets.try_emplace(header->ssrc(), uint16_t(0));
+			if (inserted)
+				it->second = uint16_t(mNextSeqNumber - seqNumber);
+
+			const uint16_t rewritten = uint16_t(seqNumber + it->second);
+			if (int16_t(rewritten - mNextSeqNumber) >= 0)
+				mNextSeqNumber = uint16_t(rewritten + 1);
+
+			header->setSsrc(*mSsrc);
+			header->setSeqNumber(rewritten);
+		}
+	}
+
+	mStats->mediaBytes += packet.size();
+	track->send(packet.data(), packet.size());
+
+	mStats->addLatency(uint64_t(
+	    std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - start).count()));
+}
+
+// DataChannel echo
+// Messages are pulled from the channel with receive() instead of onMessage, so the
+// payload is moved back into send() without a copy and nothing more is read while
+// more than EchoBufferHighWatermark bytes wait to be sent. Unread messages stay in
+// the receive queue, which in turn stops SCTP from opening the remote window.
+class DataChannelEcho {
+public:
+	DataChannelEcho(std::shared_ptr<rtc::DataChannel> dc, Stats *stats);
+	~DataChannelEcho();
+
+	void drain();
+
+private:
+	void updateBuffered(size_t buffered);
+
+	std::weak_ptr<rtc::DataChannel> mDataChannel;
+	Stats *mStats;
+	std::recursive_mutex mMutex; // send() may trigger onBufferedAmountLow on the same thread
+	size_t mBuffered = 0;
+};
+
+DataChannelEcho::DataChannelEcho(std::shared_ptr<rtc::DataChannel> dc, Stats *stats)
+    : mDataChannel(dc), mStats(stats) {
+	dc->setBufferedAmountLowThreshold(EchoBufferHighWatermark / 2);
+	++mStats->channels;
+}
+
+DataChannelEcho::~DataChannelEcho() {
+	updateBuffered(0);
+	--mStats->channels;
+}
+
+void DataChannelEcho::drain() {
+	std::lock_guard lock(mMutex);
+	auto dc = mDataChannel.lock();
+	if (!dc)
+		return;
+
+	while (dc->bufferedAmount() < EchoBufferHighWatermark) {
+		auto message = dc->receive();
+		if (!message)
+			break;
+
+		// send() returns false when the message is buffered rather than sent at once,
+		// the high watermark above is what stops the loop.
+		const size_t size = std::visit([](const auto &data) { return data.size(); }, *message);
+		dc->send(std::move(*message));
+
+		++mStats->dcMessages;
+		mStats->dcBytes += size;
+	}
+
+	updateBuffered(dc->bufferedAmount());
+}
+
+void DataChannelEcho::updateBuffered(size_t buffered) {
+	mStats->dcBuffered += int64_t(buffered) - int64_t(mBuffered);
+	mBuffered = buffered;
+}
+
+// DTLS certificate
+// libdatachannel generates a single certificate per key type, shared by all peer
+// connections, but only when the first one is created, so the first offers would
+// wait for key generation. warmUp() creates a throwaway connection before the server
+// listens so the certificate is ready. A certificate loaded from PEM files is read
+// once and handed to each connection as a string, and can be reloaded on a timer to
+// pick up a renewed certificate without a restart.
+class Certificate {
+public:
+	explicit Certificate(const Options &options);
+
+	void apply(rtc::Configuration &config) const;
+	void reload();
+	void warmUp() const;
+
+private:
+	static std::string ReadFile(const std::string &filename);
+
+	const rtc::CertificateType mType;
+	const std::optional<std::string> mCertificateFile;
+	const std::optional<std::string> mKeyFile;
+	std::string mCertificatePem;
+	std::string mKeyPem;
+};
+
+Certificate::Certificate(const Options &options)
+    : mType(options.certificateType), mCertificateFile(options.certificateFile),
+      mKeyFile(options.keyFile) {
+	if (mCertificateFile.has_value() != mKeyFile.has_value())
+		throw std::invalid_argument("Both the certificate and the key files are required");
+
+	reload();
+}
+
+std::string Certificate::ReadFile(const std::string &filename) {
+	std::ifstream file(filename, std::ios::binary);
+	if (!file)
+		throw std::runtime_error("Failed to open \"" + filename + "\"");
+
+	std::ostringstream content;
+	content << file.rdbuf();
+	return content.str();
+}
+
+void Certificate::reload() {
+	if (!mCertificateFile)
+		return;
+
+	// Keep the current certificate if the files are being replaced
+	try {
+		auto certificatePem = ReadFile(*mCertificateFile);
+		auto keyPem = ReadFile(*mKeyFile);
+		mCertificatePem = std::move(certificatePem);
+		mKeyPem = std::move(keyPem);
+
+	} catch (const std::exception &e) {
+		if (mCertificatePem.empty())
+			throw;
+
+		std::cerr << "Certificate reload failed: " << e.what() << std::endl;
+	}
+}
+
+void Certificate::apply(rtc::Configuration &config) const {
+	config.certificateType = mType;
+	if (mCertificateFile) {
+		config.certificatePemFile = mCertificatePem;
+		config.keyPemFile = mKeyPem;
+	}
+}
+
+void Certificate::warmUp() const {
+	const auto start = clock_type::now();
+
+	rtc::Configuration config;
+	apply(config);
+	rtc::PeerConnection pc(std::move(config));
+
+	// The local description carries the certificate fingerprint
+	std::promise<void> ready;
+	std::once_flag once;
+	pc.onLocalDescription(
+	    [&](rtc::Description) { std::call_once(once, [&]() { ready.set_value(); }); });
+	pc.createDataChannel("warmup");
+
+	if (ready.get_future().wait_for(CertificateTimeout) != std::future_status::ready)
+		throw std::runtime_error("Timed out waiting for the DTLS certificate");
+
+	pc.onLocalDescription(nullptr);
+	pc.close();
+
+	std::cout << "DTLS certificate ready in "
+	          << std::chrono::duration_cast<std::chrono::milliseconds>(clock_type::now() - start)
+	                 .count()
+	          << " ms" << std::endl;
+}
+
+// Current resident set size of the process in bytes, 0 where unsupported
+static size_t ResidentMemory() {
+#ifdef __linux__
+	std::ifstream statm("/proc/self/statm");
+	size_t size = 0, resident = 0;
+	if (statm >> size >> resident)
+		return resident * size_t(sysconf(_SC_PAGESIZE));
+#endif
+	return 0;
+}
+
+// Number of open file descriptors, 0 where unsupported
+static size_t OpenFileDescriptors() {
+	size_t count = 0;
+#ifdef __linux__
+	if (auto dir = opendir("/proc/self/fd")) {
+		while (auto entry = readdir(dir))
+			if (entry->d_name[0] != '.')
+				++count;
+
+		closedir(dir);
+		--count; // the descriptor of the directory itself
+	}
+#endif
+	return count;
+}
+
+// HTTP signalling front end
+// Requests are parked on a single libevent loop while ICE gathering runs on the
+// libdatachannel threads, and the answer is sent back from onGatheringStateChange
+// by posting a completion to the loop. No thread is blocked per offer.
+//
+// Each peer connection, and the channels and tracks it opens, is owned by a session
+// in a registry on the loop. Callbacks only hold weak references, so nothing keeps
+// itself alive: a session is released when the connection is closed or fails, or
+// by the reaper if it never connects or stays idle.
+class Signaling {
+public:
+	Signaling(const std::string &host, int port, Options options);
+	~Signaling();
+
+	void run();
+
+private:
+	enum class ReapReason { Closed, Failed, Timeout, Unconnected, Idle, Count };
+
+	struct Session {
+		std::shared_ptr<rtc::PeerConnection> pc;
+		clock_type::time_point created;
+		std::shared_ptr<std::atomic<clock_type::rep>> activity; // time of the last echo
+
+		std::mutex mutex; // channels and tracks are added from libdatachannel threads
+		std::vector<std::shared_ptr<rtc::DataChannel>> channels;
+		std::vector<std::shared_ptr<rtc::Track>> tracks;
+	};
+
+	struct Pending {
+		Signaling *signaling;
+		uint64_t id;
+		evhttp_request *req;
+		event *timeout;
+	};
+
+	struct Reap {
+		Signaling *signaling;
+		uint64_t id;
+		ReapReason reason;
+	};
+
+	struct Completion {
+		Signaling *signaling;
+		uint64_t id;
+		int code;
+		std::string body;
+	};
+
+	static void OnRequest(evhttp_request *req, void *arg);
+	static void OnCompletion(evutil_socket_t, short, void *arg);
+	static void OnTimeout(evutil_socket_t, short, void *arg);
+	static void OnStats(evutil_socket_t, short, void *arg);
+	static void OnCertificateReload(evutil_socket_t, short, void *arg);
+	static void OnReap(evutil_socket_t, short, void *arg);
+	static void OnReaper(evutil_socket_t, short, void *arg);
+
+	void handleOffer(evhttp_request *req);
+	void post(uint64_t id, int code, std::string body); // thread-safe
+	void complete(uint64_t id, int code, const std::string &body);
+	void postReap(uint64_t id, ReapReason reason); // thread-safe
+	void reap(uint64_t id, ReapReason reason);
+	void reapExpired();
+
+	void reportStats();
+
+	const Options mOptions;
+	event_base *mBase;
+	evhttp *mHttp;
+	event *mStatsTimer = nullptr;
+	event *mCertificateTimer = nullptr;
+	event *mReaperTimer = nullptr;
+
+	Certificate mCertificate;
+
+	Stats mStats;
+	uint64_t mLastRtpPackets = 0;
+	uint64_t mLastRtcpPackets = 0;
+	uint64_t mLastMediaBytes = 0;
+	uint64_t mLastDcMessages = 0;
+	uint64_t mLastDcBytes = 0;
+	clock_type::time_point mLastReport;
+
+	// Only accessed from the event loop thread
+	std::unordered_map<uint64_t, std::unique_ptr<Pending>> mPending;
+	std::unordered_map<uint64_t, std::shared_ptr<Session>> mSessions;
+	uint64_t mReaped[size_t(ReapReason::Count)] = {};
+	uint64_t mLastReaped = 0;
+	size_t mBaseMemory = 0;
+	uint64_t mNextId = 0;
+};
+
+Signaling::Signaling(const std::string &host, int port, Options options)
+    : mOptions(std::move(options)), mCertificate(mOptions) {
+	mCertificate.warmUp();
+
+#ifdef _WIN32
+	evthread_use_windows_threads();
+#else
+	evthread_use_pthreads();
+#endif
+
+	if (!(mBase = event_base_new()))
+		throw std::runtime_error("Failed to create event base");
+
+	if (!(mHttp = evhttp_new(mBase)))
+		throw std::runtime_error("Failed to create HTTP server");
+
+	evhttp_set_allowed_methods(mHttp, EVHTTP_REQ_POST | EVHTTP_REQ_OPTIONS);
+	evhttp_set_cb(mHttp, "/offer", Signaling::OnRequest, this);
+
+	if (evhttp_bind_socket(mHttp, host.c_str(), uint16_t(port)) != 0)
+		throw std::runtime_error("Failed to listen on port " + std::to_string(port));
+
+	if (mOptions.statsInterval.count() > 0) {
+		mStatsTimer = event_new(mBase, -1, EV_PERSIST, Signaling::OnStats, this);
+		const timeval tv = {long(mOptions.statsInterval.count()), 0};
+		evtimer_add(mStatsTimer, &tv);
+		mLastReport = clock_type::now();
+	}
+
+	// Per session memory is reported relative to the footprint before the first offer
+	mBaseMemory = ResidentMemory();
+
+	mReaperTimer = event_new(mBase, -1, EV_PERSIST, Signaling::OnReaper, this);
+	const auto reapInterval = std::chrono::duration_cast<std::chrono::microseconds>(ReapInterval);
+	const timeval reapTv = {long(reapInterval.count() / 1000000),
+	                        long(reapInterval.count() % 1000000)};
+	evtimer_add(mReaperTimer, &reapTv);
+
+	if (mOptions.certificateFile && mOptions.certificateReload.count() > 0) {
+		mCertificateTimer = event_new(mBase, -1, EV_PERSIST, Signaling::OnCertificateReload, this);
+		const timeval tv = {long(mOptions.certificateReload.count()), 0};
+		evtimer_add(mCertificateTimer, &tv);
+	}
+}
+
+Signaling::~Signaling() {
+	for (auto &[id, pending] : mPending)
+		event_free(pending->timeout);
+	mPending.clear();
+
+	for (auto &[id, session] : mSessions)
+		session->pc->close();
+	mSessions.clear();
+
+	event_free(mReaperTimer);
+
+	if (mStatsTimer)
+		event_free(mStatsTimer);
+
+	if (mCertificateTimer)
+		event_free(mCertificateTimer);
+
+	evhttp_free(mHttp);
+	event_base_free(mBase);
+}
+
+void Signaling::run() { event_base_dispatch(mBase); }
+
+void Signaling::OnRequest(evhttp_request *req, void *arg) {
+	auto signaling = static_cast<Signaling *>(arg);
+	auto headers = evhttp_request_get_output_headers(req);
+	evhttp_add_header(headers, "Access-Control-Allow-Origin", "*");
+
+	if (evhttp_request_get_command(req) == EVHTTP_REQ_OPTIONS) {
+		evhttp_add_header(headers, "Access-Control-Allow-Methods", "POST");
+		evhttp_add_header(headers, "Access-Control-Allow-Headers", "content-type");
+		evhttp_send_reply(req, 200, "OK", nullptr);
+		return;
+	}
+
+	try {
+		signaling->handleOffer(req);
+
+	} catch (const std::exception &e) {
+		std::cerr << "Offer failed: " << e.what() << std::endl;
+		auto buffer = evbuffer_new();
+		evbuffer_add_printf(buffer, "500 Internal Server Error");
+		evhttp_send_reply(req, 500, "Internal Server Error", buffer);
+		evbuffer_free(buffer);
+	}
+}
+
+void Signaling::handleOffer(evhttp_request *req) {
+	auto input = evhttp_request_get_input_buffer(req);
+	auto length = evbuffer_get_length(input);
+	auto data = reinterpret_cast<const char *>(evbuffer_pullup(input, -1));
+
+	auto parsed = json::parse(data, data + length);
+	rtc::Description remote(parsed["sdp"].get<std::string>(), parsed["type"].get<std::string>());
+
+	rtc::Configuration config;
+	mCertificate.apply(config);
+	config.enableIceUdpMux = mOptions.udpMux;
+	config.bindAddress = mOptions.bindAddress;
+	if (mOptions.portRangeBegin > 0) {
+		config.portRangeBegin = mOptions.portRangeBegin;
+		config.portRangeEnd = mOptions.portRangeEnd;
+	}
+	if (mOptions.dataChannelEcho)
+		config.maxMessageSize = EchoMaxMessageSize;
+
+	auto pc = std::make_shared<rtc::PeerConnection>(std::move(config));
+
+	const uint64_t id = mNextId++;
+	auto session = std::make_shared<Session>();
+	session->pc = pc;
+	session->created = clock_type::now();
+	session->activity =
+	    std::make_shared<std::atomic<clock_type::rep>>(session->created.time_since_epoch().count());
+	mSessions.emplace(id, session);
+
+	auto pending = std::make_unique<Pending>(Pending{this, id, req, nullptr});
+	pending->timeout = evtimer_new(mBase, Signaling::OnTimeout, pending.get());
+	const auto timeout = std::chrono::duration_cast<std::chrono::microseconds>(GatheringTimeout);
+	const timeval tv = {long(timeout.count() / 1000000), long(timeout.count() % 1000000)};
+	evtimer_add(pending->timeout, &tv);
+	mPending.emplace(id, std::move(pending));
+
+	// The callbacks are stored in the connection, its channels and its tracks, so they
+	// must not hold a strong reference to any of them or the session would never be freed
+	std::weak_ptr<rtc::PeerConnection> weakPc = pc;
+	std::weak_ptr<Session> weakSession = session;
+	auto activity = session->activity;
+	auto touch = [activity]() {
+		activity->store(clock_type::now().time_since_epoch().count(), std::memory_order_relaxed);
+	};
+
+	pc->onGatheringStateChange([this, id, weakPc](rtc::PeerConnection::GatheringState state) {
+		if (state == rtc::PeerConnection::GatheringState::Complete) {
+			auto pc = weakPc.lock();
+			if (!pc)
+				return;
+
+			try {
+				auto local = pc->localDescription().value();
+				json msg;
+				msg["sdp"] = std::string(local);
+				msg["type"] = local.typeString();
+				post(id, 200, msg.dump());
+
+			} catch (const std::exception &e) {
+				std::cerr << "Answer failed: " << e.what() << std::endl;
+				post(id, 500, "500 Internal Server Error");
 			}
-		});
+		}
+	});
 
-		pc->onStateChange([pc](rtc::PeerConnection::State state) {
-			if (state == rtc::PeerConnection::State::Disconnected) {
-				pc->close();
+	pc->onStateChange([this, id](rtc::PeerConnection::State state) {
+		using State = rtc::PeerConnection::State;
+		if (state == State::Disconnected || state == State::Closed)
+			postReap(id, ReapReason::Closed);
+		else if (state == State::Failed)
+			postReap(id, ReapReason::Failed);
+	});
+
+	if (mOptions.dataChannelEcho) {
+		pc->onDataChannel([this, weakSession, touch](std::shared_ptr<rtc::DataChannel> dc) {
+			auto echo = std::make_shared<DataChannelEcho>(dc, &mStats);
+			dc->onAvailable([echo, touch]() {
+				touch();
+				echo->drain();
+			});
+			dc->onBufferedAmountLow([echo]() { echo->drain(); });
+			if (auto session = weakSession.lock()) {
+				std::lock_guard lock(session->mutex);
+				session->channels.push_back(dc);
 			}
+			echo->drain();
 		});
-
-		pc->onDataChannel([](std::shared_ptr<rtc::DataChannel> dc) {
-			dc->onMessage([dc](auto msg) { dc->send(msg); });
+	} else {
+		pc->onDataChannel([weakSession, touch](std::shared_ptr<rtc::DataChannel> dc) {
+			std::weak_ptr<rtc::DataChannel> weakDc = dc;
+			dc->onMessage([weakDc, touch](auto msg) {
+				touch();
+				if (auto dc = weakDc.lock())
+					dc->send(msg);
+			});
+			if (auto session = weakSession.lock()) {
+				std::lock_guard lock(session->mutex);
+				session->channels.push_back(dc);
+			}
 		});
+	}
 
-		pc->onTrack([](std::shared_ptr<rtc::Track> tr) {
-			tr->onMessage([tr](auto msg) { tr->send(msg); });
+	if (mOptions.rtpReflector) {
+		pc->onTrack([this, weakSession, touch](std::shared_ptr<rtc::Track> tr) {
+			auto reflector = std::make_shared<RtpReflector>(tr, &mStats);
+			tr->onMessage(
+			    [reflector, touch](rtc::binary packet) {
+				    touch();
+				    reflector->reflect(std::move(packet));
+			    },
+			    [](rtc::string) {});
+			if (auto session = weakSession.lock()) {
+				std::lock_guard lock(session->mutex);
+				session->tracks.push_back(tr);
+			}
+		});
+	} else {
+		pc->onTrack([weakSession, touch](std::shared_ptr<rtc::Track> tr) {
+			std::weak_ptr<rtc::Track> weakTr = tr;
+			tr->onMessage([weakTr, touch](auto msg) {
+				touch();
+				if (auto tr = weakTr.lock())
+					tr->send(msg);
+			});
+			if (auto session = weakSession.lock()) {
+				std::lock_guard lock(session->mutex);
+				session->tracks.push_back(tr);
+			}
 		});
+	}
 
+	try {
 		pc->setRemoteDescription(std::move(remote));
 
-		auto body = future.get();
-		res.set_content(body, "application/json");
-	});
+	} catch (...) {
+		// The caller replies with an error, so the request must not be completed again
+		auto it = mPending.find(id);
+		event_free(it->second->timeout);
+		mPending.erase(it);
+		reap(id, ReapReason::Failed);
+		throw;
+	}
+}
 
-	srv.set_exception_handler([](const http::Request &req, http::Response &res, std::exception &e) {
-		res.status = 500;
-		res.set_content("500 Internal Server Error", "text/plain");
-	});
+void Signaling::post(uint64_t id, int code, std::string body) {
+	auto completion = new Completion{this, id, code, std::move(body)};
+	if (event_base_once(mBase, -1, EV_TIMEOUT, Signaling::OnCompletion, completion, nullptr) != 0) {
+		std::cerr << "Failed to post answer to the event loop" << std::endl;
+		delete completion;
+	}
+}
+
+void Signaling::OnCompletion(evutil_socket_t, short, void *arg) {
+	std::unique_ptr<Completion> completion(static_cast<Completion *>(arg));
+	completion->signaling->complete(completion->id, completion->code, completion->body);
+}
+
+void Signaling::OnTimeout(evutil_socket_t, short, void *arg) {
+	auto pending = static_cast<Pending *>(arg);
+	auto signaling = pending->signaling;
+	const uint64_t id = pending->id;
+	signaling->complete(id, 504, "504 Gateway Timeout"); // frees pending
+	signaling->reap(id, ReapReason::Timeout);
+}
+
+void Signaling::postReap(uint64_t id, ReapReason reason) {
+	auto reap = new Reap{this, id, reason};
+	if (event_base_once(mBase, -1, EV_TIMEOUT, Signaling::OnReap, reap, nullptr) != 0) {
+		std::cerr << "Failed to post session release to the event loop" << std::endl;
+		delete reap;
+	}
+}
+
+void Signaling::OnReap(evutil_socket_t, short, void *arg) {
+	std::unique_ptr<Reap> reap(static_cast<Reap *>(arg));
+	reap->signaling->reap(reap->id, reap->reason);
+}
+
+void Signaling::OnReaper(evutil_socket_t, short, void *arg) {
+	static_cast<Signaling *>(arg)->reapExpired();
+}
+
+void Signaling::reap(uint64_t id, ReapReason reason) {
+	auto it = mSessions.find(id);
+	if (it == mSessions.end())
+		return; // already released
+
+	auto session = std::move(it->second);
+	mSessions.erase(it);
+	++mReaped[size_t(reason)];
+
+	// Closing resets the callbacks, the channels and tracks are released with the session
+	session->pc->close();
+}
+
+void Signaling::reapExpired() {
+	const auto now = clock_type::now();
+	std::vector<std::pair<uint64_t, ReapReason>> expired;
+	for (const auto &[id, session] : mSessions) {
+		if (session->pc->state() != rtc::PeerConnection::State::Connected) {
+			if (now - session->created > ConnectTimeout)
+				expired.emplace_back(id, ReapReason::Unconnected);
+
+		} else if (mOptions.idleTimeout.count() > 0) {
+			const clock_type::time_point activity(clock_type::duration(
+			    session->activity->load(std::memory_order_relaxed)));
+			if (now - activity > mOptions.idleTimeout)
+				expired.emplace_back(id, ReapReason::Idle);
+		}
+	}
+
+	for (const auto &[id, reason] : expired)
+		reap(id, reason);
+}
+
+void Signaling::OnStats(evutil_socket_t, short, void *arg) {
+	static_cast<Signaling *>(arg)->reportStats();
+}
+
+void Signaling::OnCertificateReload(evutil_socket_t, short, void *arg) {
+	static_cast<Signaling *>(arg)->mCertificate.reload();
+}
+
+void Signaling::reportStats() {
+	const auto now = clock_type::now();
+	const double elapsed = std::chrono::duration<double>(now - mLastReport).count();
+	mLastReport = now;
+
+	const uint64_t rtpPackets = mStats.rtpPackets;
+	const uint64_t rtcpPackets = mStats.rtcpPackets;
+	const uint64_t mediaBytes = mStats.mediaBytes;
+	const uint64_t packets = (rtpPackets - mLastRtpPackets) + (rtcpPackets - mLastRtcpPackets);
+	const uint64_t bytes = mediaBytes - mLastMediaBytes;
+	mLastRtpPackets = rtpPackets;
+	mLastRtcpPackets = rtcpPackets;
+	mLastMediaBytes = mediaBytes;
+
+	const uint64_t latencyTotal = mStats.latencyTotal.exchange(0);
+	const uint64_t latencyMax = mStats.latencyMax.exchange(0);
+	if (packets > 0)
+		std::cout << std::fixed << std::setprecision(1) << "RTP echo: " << mStats.tracks
+		          << " tracks, " << double(packets) / elapsed << " packets/s, "
+		          << double(bytes) * 8. / elapsed / 1e6 << " Mbit/s, latency avg "
+		          << double(latencyTotal) / double(packets) / 1e3 << " us, max "
+		          << double(latencyMax) / 1e3 << " us" << std::endl;
+
+	const uint64_t dcMessages = mStats.dcMessages;
+	const uint64_t dcBytes = mStats.dcBytes;
+	const uint64_t messages = dcMessages - mLastDcMessages;
+	const uint64_t messageBytes = dcBytes - mLastDcBytes;
+	mLastDcMessages = dcMessages;
+	mLastDcBytes = dcBytes;
+	const int64_t buffered = mStats.dcBuffered;
+	if (messages > 0 || buffered > 0)
+		std::cout << std::fixed << std::setprecision(1) << "DataChannel echo: " << mStats.channels
+		          << " channels, " << double(messages) / elapsed << " messages/s, "
+		          << double(messageBytes) / elapsed / 1e6 << " MB/s, buffered "
+		          << double(buffered) / 1024. << " KiB" << std::endl;
+
+	uint64_t reaped = 0;
+	for (uint64_t count : mReaped)
+		reaped += count;
+	if (!mSessions.empty() || reaped != mLastReaped) {
+		const size_t memory = ResidentMemory();
+		std::cout << std::fixed << std::setprecision(1) << "Sessions: " << mSessions.size()
+		          << " live, released " << mReaped[size_t(ReapReason::Closed)] << " closed, "
+		          << mReaped[size_t(ReapReason::Failed)] << " failed, "
+		          << mReaped[size_t(ReapReason::Timeout)] << " timed out, "
+		          << mReaped[size_t(ReapReason::Unconnected)] << " unconnected, "
+		          << mReaped[size_t(ReapReason::Idle)] << " idle";
+		if (const size_t fds = OpenFileDescriptors(); fds > 0)
+			std::cout << ", " << fds << " file descriptors";
+		if (memory > 0) {
+			std::cout << ", RSS " << double(memory) / (1024. * 1024.) << " MiB";
+			if (!mSessions.empty() && memory > mBaseMemory)
+				std::cout << ", " << double(memory - mBaseMemory) / 1024. / double(mSessions.size())
+				          << " KiB per session";
+		}
+		std::cout << std::endl;
+	}
+	mLastReaped = reaped;
+}
+
+void Signaling::complete(uint64_t id, int code, const std::string &body) {
+	auto it = mPending.find(id);
+	if (it == mPending.end())
+		return; // already completed or timed out
+
+	auto pending = std::move(it->second);
+	mPending.erase(it);
+	event_free(pending->timeout);
+
+	auto req = pending->req;
+	auto buffer = evbuffer_new();
+	evbuffer_add(buffer, body.data(), body.size());
+	if (code == 200) {
+		evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type",
+		                  "application/json");
+		evhttp_send_reply(req, 200, "OK", buffer);
+	} else {
+		evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type", "text/plain");
+		evhttp_send_reply(req, code, nullptr, buffer);
+	}
+	evbuffer_free(buffer);
+}
+
+// Prints the command line options
+static void PrintUsage(std::ostream &out, const char *program) {
+	out
+	    << "Usage: " << program << "[PORT|<options>]\n"
+	    << "Options:\n"
+	    << "\t-h,\t\tShow this help message\n"
+	    << "\t-p PORT\t\tSpecify the listening port (default 8080)\n"
+	    << "\t-r,\t\tEcho media with the RTP reflector\n"
+	    << "\t-d,\t\tEcho DataChannel messages without copies and with backpressure\n"
+	    << "\t-i SECONDS\tSpecify the statistics interval, 0 to disable (default 5)\n"
+	    << "\t-t TYPE\t\tSpecify the generated certificate key type, ecdsa or rsa\n"
+	    << "\t-c FILE\t\tUse the PEM certificate in FILE instead of generating one\n"
+	    << "\t-k FILE\t\tSpecify the PEM private key for the certificate\n"
+	    << "\t-R SECONDS\tReload the PEM certificate and key every SECONDS (default 0, never)\n"
+	    << "\t-I SECONDS\tRelease sessions idle for SECONDS, 0 to disable (default 0)\n"
+	    << "\t-m,\t\tMultiplex the ICE traffic of all connections on one UDP port\n"
+	    << "\t-b ADDRESS\tSpecify the local address for ICE (default all addresses)\n"
+	    << "\t-P BEGIN[-END]\tSpecify the local UDP port range for ICE (default 50000 with -m)\n"
+	    << std::endl;
+}
+
+// Parses a whole decimal number within [min, max], throws std::invalid_argument otherwise
+static long ParseNumber(const std::string &option, const std::string &text, long min, long max) {
+	errno = 0;
+	char *end = nullptr;
+	const long value = std::strtol(text.c_str(), &end, 10);
+	if (text.empty() || *end != '\0' || errno == ERANGE || value < min || value > max)
+		throw std::invalid_argument("Invalid value \"" + text + "\" for option \"" + option +
+		                            "\", expected a number from " + std::to_string(min) +
+		                            " to " + std::to_string(max));
+	return value;
+}
+
+int main(int argc, char **argv) try {
+	// Default arguments
+	const std::string host = "0.0.0.0";
+	int port = 8080;
+	Options options;
+
+	// Parse arguments
+	try {
+		for (int i = 1; i < argc; ++i) {
+			std::string arg = argv[i];
+			if (!arg.empty() && arg[0] == '-') {
+				std::string option = arg.substr(1);
+				if (option == "h") {
+					PrintUsage(std::cout, argv[0]);
+					return 0;
+				} else if (option == "p") {
+					if (i + 1 == argc)
+						throw std::invalid_argument("Missing argument for option \"p\"");
+					port = int(ParseNumber("p", argv[++i], 1, 65535));
+				} else if (option == "r") {
+					options.rtpReflector = true;
+				} else if (option == "d") {
+					options.dataChannelEcho = true;
+				} else if (option == "i") {
+					if (i + 1 == argc)
+						throw std::invalid_argument("Missing argument for option \"i\"");
+					options.statsInterval = std::chrono::seconds(ParseNumber("i", argv[++i], 0, 86400));
+				} else if (option == "t") {
+					if (i + 1 == argc)
+						throw std::invalid_argument("Missing argument for option \"t\"");
+					const std::string type = argv[++i];
+					if (type == "ecdsa")
+						options.certificateType = rtc::CertificateType::Ecdsa;
+					else if (type == "rsa")
+						options.certificateType = rtc::CertificateType::Rsa;
+					else
+						throw std::invalid_argument("Unknown certificate type \"" + type + "\"");
+				} else if (option == "c") {
+					if (i + 1 == argc)
+						throw std::invalid_argument("Missing argument for option \"c\"");
+					options.certificateFile = argv[++i];
+				} else if (option == "k") {
+					if (i + 1 == argc)
+						throw std::invalid_argument("Missing argument for option \"k\"");
+					options.keyFile = argv[++i];
+				} else if (option == "R") {
+					if (i + 1 == argc)
+						throw std::invalid_argument("Missing argument for option \"R\"");
+					options.certificateReload = std::chrono::seconds(ParseNumber("R", argv[++i], 0, 31536000));
+				} else if (option == "I") {
+					if (i + 1 == argc)
+						throw std::invalid_argument("Missing argument for option \"I\"");
+					options.idleTimeout = std::chrono::seconds(ParseNumber("I", argv[++i], 0, 86400));
+				} else if (option == "m") {
+					options.udpMux = true;
+				} else if (option == "b") {
+					if (i + 1 == argc)
+						throw std::invalid_argument("Missing argument for option \"b\"");
+					options.bindAddress = argv[++i];
+				} else if (option == "P") {
+					if (i + 1 == argc)
+						throw std::invalid_argument("Missing argument for option \"P\"");
+					const std::string range = argv[++i];
+					const auto separator = range.find('-');
+					const long begin = ParseNumber("P", range.substr(0, separator), 1, 65535);
+					const long end = separator != std::string::npos
+					                     ? ParseNumber("P", range.substr(separator + 1), begin, 65535)
+					                     : begin;
+					options.portRangeBegin = uint16_t(begin);
+					options.portRangeEnd = uint16_t(end);
+				} else {
+					throw std::invalid_argument("Unknown option \"" + option + "\"");
+				}
+			} else {
+				if (i > 1)
+					throw std::invalid_argument("Unexpected positional argument \"" + arg + "\"");
+				port = int(ParseNumber("PORT", arg, 1, 65535));
+			}
+		}
+	} catch (const std::invalid_argument &e) {
+		std::cerr << e.what() << std::endl;
+		PrintUsage(std::cerr, argv[0]);
+		return -1;
+	}
+
+	if (options.udpMux && options.portRangeBegin == 0)
+		options.portRangeBegin = options.portRangeEnd = DefaultMuxPort;
+
+	rtc::InitLogger(rtc::LogLevel::Warning);
+
+	Signaling signaling(host, port, options);
 
 	std::cout << "Listening on " << host << ":" << port << "..." << std::endl;
-	if (!srv.listen(host.c_str(), port))
-		throw std::runtime_error("Failed to listen on port " + std::to_string(port));
+	if (options.udpMux)
+		std::cout << "ICE UDP mux on port " << options.portRangeBegin << std::endl;
+	signaling.run();
 
 	return 0;
 
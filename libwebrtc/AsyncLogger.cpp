@@ -0,0 +1,213 @@
+/******************************************************************************
+* Filename: AsyncLogger.cpp
+*
+* Description: See header file.
+*
+* License: Public Domain (no warranty, use at own risk)
+/******************************************************************************/
+
+#include "AsyncLogger.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+// How long the flusher sleeps when the ring is empty.
+#define FLUSH_INTERVAL_MILLISECONDS 5
+
+static const char* LevelName(LogLevel level)
+{
+  switch (level) {
+  case LogLevel::Debug: return "DEBUG";
+  case LogLevel::Info: return "INFO";
+  case LogLevel::Warning: return "WARN";
+  case LogLevel::Error: return "ERROR";
+  default: return "";
+  }
+}
+
+static void FormatLine(std::string& out, LogLevel level, std::chrono::system_clock::time_point time, std::string_view message)
+{
+  auto seconds = std::chrono::system_clock::to_time_t(time);
+  auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch()).count() % 1000;
+
+  std::tm tm = {};
+#ifdef _WIN32
+  gmtime_s(&tm, &seconds);
+#else
+  gmtime_r(&seconds, &tm);
+#endif
+
+  char prefix[64];
+  size_t length = std::strftime(prefix, sizeof(prefix), "%Y-%m-%dT%H:%M:%S", &tm);
+  length += snprintf(prefix + length, sizeof(prefix) - length, ".%03dZ %-5s ", static_cast<int>(millis), LevelName(level));
+
+  out.append(prefix, length);
+  out.append(message);
+  out.push_back('\n');
+}
+
+AsyncLogger& AsyncLogger::Instance()
+{
+  static AsyncLogger logger;
+  return logger;
+}
+
+AsyncLogger::AsyncLogger() :
+  _head(0),
+  _tail(0),
+  _dropped(0),
+  _level(LogLevel::Info),
+  _logSdp(false),
+  _running(false),
+  _writers(0)
+{
+  for (size_t i = 0; i < RING_SIZE; i++) {
+    _ring[i].sequence.store(i, std::memory_order_relaxed);
+  }
+}
+
+AsyncLogger::~AsyncLogger()
+{
+  Stop();
+}
+
+void AsyncLogger::Start(LogLevel level, bool logSdp)
+{
+  _level = level;
+  _logSdp = logSdp;
+
+  if (!_running.exchange(true)) {
+    _flusher = std::thread([this]() { Run(); });
+  }
+}
+
+void AsyncLogger::Stop()
+{
+  if (_running.exchange(false)) {
+    _flusher.join();
+
+    // A write that saw the logger running may still be filling its slot.
+    while (_writers.load() != 0) {
+      std::this_thread::yield();
+    }
+    Flush();
+  }
+}
+
+bool AsyncLogger::ParseLevel(const std::string& name, LogLevel& level)
+{
+  if (name == "debug") level = LogLevel::Debug;
+  else if (name == "info") level = LogLevel::Info;
+  else if (name == "warning") level = LogLevel::Warning;
+  else if (name == "error") level = LogLevel::Error;
+  else if (name == "none") level = LogLevel::None;
+  else return false;
+  return true;
+}
+
+/**
+* Claims a slot with a CAS on the head, the slot's sequence number says whether
+* the flusher has finished with it (bounded MPMC queue as described by Dmitry
+* Vyukov, with a single consumer).
+*/
+void AsyncLogger::Write(LogLevel level, std::string_view message)
+{
+  auto now = std::chrono::system_clock::now();
+
+  // Sequentially consistent with the exchange in Stop, so either Stop waits for
+  // this write or this write sees the logger stopped.
+  _writers.fetch_add(1);
+  if (!_running.load()) {
+    _writers.fetch_sub(1);
+    std::string line;
+    FormatLine(line, level, now, message);
+    fwrite(line.data(), 1, line.size(), stdout);
+    fflush(stdout);
+    return;
+  }
+
+  uint64_t pos = _head.load(std::memory_order_relaxed);
+  Slot* slot = nullptr;
+  while (true) {
+    slot = &_ring[pos & (RING_SIZE - 1)];
+    uint64_t sequence = slot->sequence.load(std::memory_order_acquire);
+    int64_t diff = static_cast<int64_t>(sequence) - static_cast<int64_t>(pos);
+    if (diff == 0) {
+      if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+        break;
+      }
+    }
+    else if (diff < 0) {
+      _dropped.fetch_add(1, std::memory_order_relaxed);
+      _writers.fetch_sub(1, std::memory_order_release);
+      return;
+    }
+    else {
+      pos = _head.load(std::memory_order_relaxed);
+    }
+  }
+
+  slot->level = level;
+  slot->time = now;
+  if (message.size() <= MAX_MESSAGE_LENGTH) {
+    slot->length = static_cast<uint32_t>(message.size());
+    slot->longText = nullptr;
+    memcpy(slot->text, message.data(), slot->length);
+  }
+  else {
+    slot->length = 0;
+    slot->longText = new std::string(message);
+  }
+  slot->sequence.store(pos + 1, std::memory_order_release);
+  _writers.fetch_sub(1, std::memory_order_release);
+}
+
+/**
+* Drains the ring into a single buffer and writes it with one call.
+*/
+void AsyncLogger::Flush()
+{
+  std::string batch;
+
+  while (true) {
+    Slot& slot = _ring[_tail & (RING_SIZE - 1)];
+    if (slot.sequence.load(std::memory_order_acquire) != _tail + 1) {
+      break;
+    }
+
+    if (slot.longText != nullptr) {
+      FormatLine(batch, slot.level, slot.time, *slot.longText);
+      delete slot.longText;
+      slot.longText = nullptr;
+    }
+    else {
+      FormatLine(batch, slot.level, slot.time, std::string_view(slot.text, slot.length));
+    }
+    slot.sequence.store(_tail + RING_SIZE, std::memory_order_release);
+    _tail++;
+  }
+
+  uint64_t dropped = _dropped.exchange(0, std::memory_order_relaxed);
+  if (dropped > 0) {
+    FormatLine(batch, LogLevel::Warning, std::chrono::system_clock::now(),
+      std::to_string(dropped) + " log messages dropped, ring full.");
+  }
+
+  if (!batch.empty()) {
+    fwrite(batch.data(), 1, batch.size(), stdout);
+    fflush(stdout);
+  }
+}
+
+void AsyncLogger::Run()
+{
+  while (_running.load(std::memory_order_acquire)) {
+    uint64_t tail = _tail;
+    Flush();
+    if (_tail == tail) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(FLUSH_INTERVAL_MILLISECONDS));
+    }
+  }
+}
@@ -0,0 +1,109 @@
+/******************************************************************************
+* Filename: AsyncLogger.h
+*
+* Description:
+* Level filtered logger that keeps console I/O off the signaling and HTTP
+* threads. Messages are copied into a fixed size lock-free ring and written out
+* in batches by a background flusher thread.
+*
+* License: Public Domain (no warranty, use at own risk)
+/******************************************************************************/
+
+#ifndef __ASYNC_LOGGER__
+#define __ASYNC_LOGGER__
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+
+enum class LogLevel {
+  Debug,
+  Info,
+  Warning,
+  Error,
+  None
+};
+
+class AsyncLogger {
+public:
+  // Number of ring slots, must be a power of two.
+  static constexpr size_t RING_SIZE = 4096;
+
+  // Longer messages, e.g. SDP dumps, are copied to the heap instead of the slot.
+  static constexpr size_t MAX_MESSAGE_LENGTH = 488;
+
+  static AsyncLogger& Instance();
+
+  /* Starts the flusher thread. Until then, and after Stop, messages are written
+  * synchronously.
+  */
+  void Start(LogLevel level, bool logSdp);
+
+  /* Writes out anything left in the ring and stops the flusher thread. */
+  void Stop();
+
+  bool IsEnabled(LogLevel level) const { return level >= _level.load(std::memory_order_relaxed); }
+  bool IsSdpEnabled() const { return _logSdp.load(std::memory_order_relaxed); }
+
+  /* Never blocks. If the ring is full the message is dropped and counted. */
+  void Write(LogLevel level, std::string_view message);
+
+  static bool ParseLevel(const std::string& name, LogLevel& level);
+
+private:
+  struct Slot {
+    std::atomic<uint64_t> sequence;
+    LogLevel level;
+    std::chrono::system_clock::time_point time;
+    uint32_t length;
+    std::string* longText;
+    char text[MAX_MESSAGE_LENGTH];
+  };
+
+  AsyncLogger();
+  ~AsyncLogger();
+
+  void Flush();
+  void Run();
+
+  std::array<Slot, RING_SIZE> _ring;
+  std::atomic<uint64_t> _head;  // Next slot to claim for writing.
+  uint64_t _tail;                // Next slot to flush, only used by the flusher.
+  std::atomic<uint64_t> _dropped;
+  std::atomic<LogLevel> _level;
+  std::atomic<bool> _logSdp;
+  std::atomic<bool> _running;
+  std::atomic<uint32_t> _writers; // Writes between their running check and publishing the slot.
+  std::thread _flusher;
+};
+
+#define ECHO_LOG(level, stream) \
+  do { \
+    if (AsyncLogger::Instance().IsEnabled(level)) { \
+      std::ostringstream _echo_log_stream; \
+      _echo_log_stream << stream; \
+      AsyncLogger::Instance().Write(level, _echo_log_stream.str()); \
+    } \
+  } while (0)
+
+#define ECHO_LOG_DEBUG(stream) ECHO_LOG(LogLevel::Debug, stream)
+#define ECHO_LOG_INFO(stream) ECHO_LOG(LogLevel::Info, stream)
+#define ECHO_LOG_WARNING(stream) ECHO_LOG(LogLevel::Warning, stream)
+#define ECHO_LOG_ERROR(stream) ECHO_LOG(LogLevel::Error, stream)
+
+// SDP dumps are only written when enabled with --log-sdp, whatever the level.
+#define ECHO_LOG_SDP(stream) \
+  do { \
+    if (AsyncLogger::Instance().IsSdpEnabled()) { \
+      std::ostringstream _echo_log_stream; \
+      _echo_log_stream << stream; \
+      AsyncLogger::Instance().Write(LogLevel::Info, _echo_log_stream.str()); \
+    } \
+  } while (0)
+
+#endif
@@ -14,74 +14,138 @@
 /******************************************************************************/
 
 #include "HttpSimpleServer.h"
+#include "AsyncLogger.h"
 
+#include <algorithm>
 #include <signal.h>
 
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#endif
+
 PcFactory* HttpSimpleServer::_pcFactory = nullptr;
 
-HttpSimpleServer::HttpSimpleServer() :
+HttpSimpleServer::HttpSimpleServer(int reactorCount) :
   _isDisposed(false)
 {
+  /* Answers are posted to the event_base from the peer connection signaling threads
+  * so the bases need to be created with locking enabled.
+  */
 #ifdef _WIN32
   evthread_use_windows_threads();
+  reactorCount = 1;
+#else
+  evthread_use_pthreads();
 #endif
 
-  /* Initialise libevent HTTP server. */
-  _evtBase = event_base_new();
-  if (!_evtBase) {
-    throw std::runtime_error("HttpSimpleServer couldn't create an event_base instance.");
-  }
+  for (int i = 0; i < std::max(reactorCount, 1); i++) {
+    auto reactor = std::make_unique<Reactor>();
+
+    /* Initialise libevent HTTP server. */
+    reactor->evtBase = event_base_new();
+    if (!reactor->evtBase) {
+      throw std::runtime_error("HttpSimpleServer couldn't create an event_base instance.");
+    }
+
+    reactor->httpSvr = evhttp_new(reactor->evtBase);
+    if (!reactor->httpSvr) {
+      throw std::runtime_error("HttpSimpleServer couldn't create an evhttp instance.");
+    }
 
-  _httpSvr = evhttp_new(_evtBase);
-  if (!_httpSvr) {
-    throw std::runtime_error("HttpSimpleServer couldn't create an evhttp instance.");
+    _reactors.push_back(std::move(reactor));
   }
 
-  _signalEvent = evsignal_new(_evtBase, SIGINT, HttpSimpleServer::OnSignal, (void*)_evtBase);
+  _signalEvent = evsignal_new(_reactors[0]->evtBase, SIGINT, HttpSimpleServer::OnSignal, this);
   if (!_signalEvent) {
     throw std::runtime_error("HttpSimpleServer couldn't create an event instance with evsignal_new.");
   }
 
   int addResult = event_add(_signalEvent, NULL);
   if (addResult < 0) {
-    std::cerr << "Failed to add signal event handler." << std::endl;
+    ECHO_LOG_ERROR("Failed to add signal event handler.");
   }
 }
 
 HttpSimpleServer::~HttpSimpleServer() {
   if (!_isDisposed) {
     _isDisposed = true;
-    event_base_loopexit(_evtBase, nullptr);
-    evhttp_free(_httpSvr);
+    for (auto& reactor : _reactors) {
+      event_base_loopexit(reactor->evtBase, nullptr);
+      if (reactor->thread.joinable()) {
+        reactor->thread.join();
+      }
+    }
     event_free(_signalEvent);
-    event_base_free(_evtBase);
+    for (auto& reactor : _reactors) {
+      evhttp_free(reactor->httpSvr);
+      event_base_free(reactor->evtBase);
+    }
   }
 }
 
 void HttpSimpleServer::Init(const char* httpServerAddress, int httpServerPort, const char* offerPath) {
 
-  int res = evhttp_bind_socket(_httpSvr, httpServerAddress, httpServerPort);
-  if (res != 0) {
-    throw std::runtime_error("HttpSimpleServer failed to start HTTP server on " +
-      std::string(httpServerAddress) + ":" + std::to_string(httpServerPort) + ".");
-  }
+  for (auto& reactor : _reactors) {
+    if (_reactors.size() == 1) {
+      int res = evhttp_bind_socket(reactor->httpSvr, httpServerAddress, httpServerPort);
+      if (res != 0) {
+        throw std::runtime_error("HttpSimpleServer failed to start HTTP server on " +
+          std::string(httpServerAddress) + ":" + std::to_string(httpServerPort) + ".");
+      }
+    }
+#ifndef _WIN32
+    else {
+      sockaddr_in sin = {};
+      sin.sin_family = AF_INET;
+      sin.sin_port = htons(httpServerPort);
+      if (inet_pton(AF_INET, httpServerAddress, &sin.sin_addr) != 1) {
+        throw std::runtime_error("HttpSimpleServer invalid IPv4 listen address " + std::string(httpServerAddress) + ".");
+      }
 
-  evhttp_set_allowed_methods(_httpSvr,
-    EVHTTP_REQ_GET |
-    EVHTTP_REQ_POST |
-    EVHTTP_REQ_OPTIONS);
+      evconnlistener* listener = evconnlistener_new_bind(reactor->evtBase, nullptr, nullptr,
+        LEV_OPT_REUSEABLE | LEV_OPT_REUSEABLE_PORT | LEV_OPT_CLOSE_ON_FREE | LEV_OPT_CLOSE_ON_EXEC,
+        -1, reinterpret_cast<sockaddr*>(&sin), sizeof(sin));
 
-  std::cout << "Waiting for SDP offer on http://"
-    + std::string(httpServerAddress) + ":" + std::to_string(httpServerPort) + offerPath << std::endl;
+      if (listener == nullptr || evhttp_bind_listener(reactor->httpSvr, listener) == nullptr) {
+        throw std::runtime_error("HttpSimpleServer failed to start HTTP server on " +
+          std::string(httpServerAddress) + ":" + std::to_string(httpServerPort) + " with SO_REUSEPORT.");
+      }
+    }
+#endif
+
+    evhttp_set_allowed_methods(reactor->httpSvr,
+      EVHTTP_REQ_GET |
+      EVHTTP_REQ_POST |
+      EVHTTP_REQ_OPTIONS);
 
-  res = evhttp_set_cb(_httpSvr, offerPath, HttpSimpleServer::OnHttpRequest, NULL);
-  if (res != 0) {
-    throw std::runtime_error("HttpSimpleServer failed to set request callback.");
+    int res = evhttp_set_cb(reactor->httpSvr, offerPath, HttpSimpleServer::OnHttpRequest, reactor->evtBase);
+    if (res != 0) {
+      throw std::runtime_error("HttpSimpleServer failed to set request callback.");
+    }
+
+    res = evhttp_set_cb(reactor->httpSvr, HTTP_METRICS_PATH, HttpSimpleServer::OnMetricsRequest, nullptr);
+    if (res != 0) {
+      throw std::runtime_error("HttpSimpleServer failed to set metrics callback.");
+    }
   }
+
+  ECHO_LOG_INFO("Waiting for SDP offer on http://"
+    + std::string(httpServerAddress) + ":" + std::to_string(httpServerPort) + offerPath
+    << " with " << _reactors.size() << " reactor(s), metrics on " << HTTP_METRICS_PATH << ".");
 }
 
+/**
+* Runs the first reactor on the calling thread and any others on their own threads.
+* Returns once the first reactor's loop exits, e.g. on SIGINT.
+*/
 void HttpSimpleServer::Run() {
-  event_base_dispatch(_evtBase);
+  for (size_t i = 1; i < _reactors.size(); i++) {
+    Reactor* reactor = _reactors[i].get();
+    reactor->thread = std::thread([reactor]() { event_base_dispatch(reactor->evtBase); });
+  }
+
+  event_base_dispatch(_reactors[0]->evtBase);
 }
 
 void HttpSimpleServer::Stop() {
@@ -95,19 +159,20 @@ void HttpSimpleServer::SetPeerConnectionFactory(PcFactory* pcFactory) {
 /**
 * The handler function for an incoming HTTP request. This is the start of the
 * handling for any WebRTC peer that wishes to establish a connection. The incoming
-* request MUST have an SDP offer in its body.
+* request MUST have an SDP offer in its body. The request is left pending and
+* the reply is sent from OnAnswer once the peer connection factory has an answer.
 * @param[in] req: the HTTP request received from the remote client.
-* @param[in] arg: not used.
+* @param[in] arg: the event_base the request was received on.
 */
 void HttpSimpleServer::OnHttpRequest(struct evhttp_request* req, void* arg)
 {
+  event_base* evtBase = static_cast<event_base*>(arg);
   const char* uri = evhttp_request_get_uri(req);
   evbuffer* http_req_body = nullptr;
   size_t http_req_body_len{ 0 };
-  char* http_req_buffer = nullptr;
   struct evbuffer* resp_buffer;
 
-  printf("Received HTTP request for %s.\n", uri);
+  ECHO_LOG_DEBUG("Received HTTP request for " << uri << ".");
 
   if (req->type == EVHTTP_REQ_OPTIONS) {
     evhttp_add_header(req->output_headers, "Access-Control-Allow-Origin", "*");
@@ -117,50 +182,123 @@ void HttpSimpleServer::OnHttpRequest(struct evhttp_request* req, void* arg)
   }
   else {
 
-    resp_buffer = evbuffer_new();
-    if (!resp_buffer) {
-      fprintf(stderr, "Failed to create HTTP response buffer.\n");
-    }
-
     evhttp_add_header(req->output_headers, "Access-Control-Allow-Origin", "*");
 
     http_req_body = evhttp_request_get_input_buffer(req);
     http_req_body_len = evbuffer_get_length(http_req_body);
 
-    if (http_req_body_len > 0) {
-      http_req_buffer = static_cast<char*>(calloc(http_req_body_len, sizeof(char)));
-
-      evbuffer_copyout(http_req_body, http_req_buffer, http_req_body_len);
+    if (http_req_body_len > 0 && _pcFactory != nullptr) {
+      // Makes the body contiguous within the evbuffer, usually without copying as
+      // an offer fits in one chain. The view is only used before CreatePeerConnection
+      // returns, the request owns the buffer until the reply is sent.
+      const char* http_req_data = reinterpret_cast<const char*>(evbuffer_pullup(http_req_body, -1));
 
-      printf("HTTP request body length %zu.\n", http_req_body_len);
+      ECHO_LOG_DEBUG("HTTP request body length " << http_req_body_len << ".");
 
-      std::string offerJson(http_req_buffer, http_req_body_len);
-      //std::cout << offerJson << std::endl;
+      _pcFactory->CreatePeerConnection(std::string_view(http_req_data, http_req_body_len), [req, evtBase](PcOutcome outcome, const std::string& answer) {
+        auto reply = new PendingReply{ req, outcome, answer };
+        if (event_base_once(evtBase, -1, EV_TIMEOUT, HttpSimpleServer::OnAnswer, reply, nullptr) != 0) {
+          ECHO_LOG_ERROR("Failed to schedule HTTP reply.");
+          delete reply;
+        }
+        });
+    }
+    else {
+      resp_buffer = evbuffer_new();
+      if (!resp_buffer) {
+        ECHO_LOG_ERROR("Failed to create HTTP response buffer.");
+        evhttp_send_reply(req, 400, "Bad Request", NULL);
+        return;
+      }
 
-      if (_pcFactory != nullptr) {
-       std::string answer = _pcFactory->CreatePeerConnection(http_req_buffer, http_req_body_len);
-       std::cout << "Answer: " << answer << std::endl;
-        evhttp_add_header(req->output_headers, "Content-type", "application/json");
-        evbuffer_add_printf(resp_buffer, "%s", answer.c_str());
-        evhttp_send_reply(req, 200, "OK", resp_buffer);
+      if (_pcFactory == nullptr) {
+        evbuffer_add_printf(resp_buffer, "No handler");
       }
       else {
-        evbuffer_add_printf(resp_buffer, "No handler");
-        evhttp_send_reply(req, 400, "Bad Request", resp_buffer);
+        evbuffer_add_printf(resp_buffer, "Request was missing the SDP offer.");
       }
-    }
-    else {
-      evbuffer_add_printf(resp_buffer, "Request was missing the SDP offer.");
       evhttp_send_reply(req, 400, "Bad Request", resp_buffer);
+      evbuffer_free(resp_buffer);
     }
   }
 }
 
+/**
+* Sends the answer for a pending request. Called on the event_base thread that
+* received the request.
+*/
+void HttpSimpleServer::OnAnswer(evutil_socket_t fd, short events, void* arg)
+{
+  std::unique_ptr<PendingReply> reply(static_cast<PendingReply*>(arg));
+  evhttp_request* req = reply->req;
+
+  struct evbuffer* resp_buffer = evbuffer_new();
+  if (!resp_buffer) {
+    // The request still has to be completed or the client is left waiting.
+    ECHO_LOG_ERROR("Failed to create HTTP response buffer.");
+    evhttp_send_reply(req, 500, "Internal Server Error", NULL);
+    return;
+  }
+
+  switch (reply->outcome) {
+  case PcOutcome::Answered:
+    ECHO_LOG_SDP("Answer: " << reply->answer);
+    evhttp_add_header(req->output_headers, "Content-type", "application/json");
+    evbuffer_add(resp_buffer, reply->answer.data(), reply->answer.size());
+    evhttp_send_reply(req, 200, "OK", resp_buffer);
+    break;
+  case PcOutcome::Invalid:
+    evbuffer_add_printf(resp_buffer, "Could not parse SDP offer.");
+    evhttp_send_reply(req, 400, "Bad Request", resp_buffer);
+    break;
+  case PcOutcome::Failed:
+    evbuffer_add_printf(resp_buffer, "Failed to create the peer connection answer.");
+    evhttp_send_reply(req, 500, "Internal Server Error", resp_buffer);
+    break;
+  default:
+    evbuffer_add_printf(resp_buffer, "No peer connection available, live %zu, peak %zu.",
+      _pcFactory->GetLiveCount(), _pcFactory->GetPeakCount());
+    evhttp_send_reply(req, 503, "Service Unavailable", resp_buffer);
+    break;
+  }
+
+  evbuffer_free(resp_buffer);
+}
+
+/**
+* Serves the peer connection factory's timing histograms and counters in the
+* Prometheus text format.
+*/
+void HttpSimpleServer::OnMetricsRequest(struct evhttp_request* req, void* arg)
+{
+  struct evbuffer* resp_buffer = evbuffer_new();
+  if (!resp_buffer) {
+    ECHO_LOG_ERROR("Failed to create HTTP response buffer.");
+    evhttp_send_reply(req, 500, "Internal Server Error", NULL);
+    return;
+  }
+
+  if (req->type != EVHTTP_REQ_GET || _pcFactory == nullptr) {
+    evbuffer_add_printf(resp_buffer, "No metrics");
+    evhttp_send_reply(req, 404, "Not Found", resp_buffer);
+  }
+  else {
+    std::string metrics = _pcFactory->GetMetrics();
+    evhttp_add_header(req->output_headers, "Content-type", "text/plain; version=0.0.4");
+    evbuffer_add(resp_buffer, metrics.data(), metrics.size());
+    evhttp_send_reply(req, 200, "OK", resp_buffer);
+  }
+
+  evbuffer_free(resp_buffer);
+}
+
 void HttpSimpleServer::OnSignal(evutil_socket_t sig, short events, void* user_data)
 {
-  event_base* base = static_cast<event_base*>(user_data);
+  HttpSimpleServer* server = static_cast<HttpSimpleServer*>(user_data);
 
-  std::cout << "Caught an interrupt signal; calling loop exit." << std::endl;
+  ECHO_LOG_INFO("Caught an interrupt signal; calling loop exit.");
 
-  event_base_loopexit(base, nullptr);
+  for (auto& reactor : server->_reactors) {
+    event_base_loopexit(reactor->evtBase, nullptr);
+  }
 }
@@ -24,19 +24,30 @@
 #include <event2/event.h>
 #include <event2/http.h>
 #include <event2/http_struct.h>
+#include <event2/listener.h>
 #include <event2/thread.h>
 #include <event2/util.h>
 
 #include <exception>
 #include <functional>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <thread>
+#include <vector>
+
+// Path the Prometheus text metrics are served on.
+#define HTTP_METRICS_PATH "/metrics"
 
 class HttpSimpleServer
 {
 public:
-  HttpSimpleServer();
+  /* Each reactor is an event_base thread with its own evhttp instance. With more
+  * than one reactor every instance binds its own listening socket with SO_REUSEPORT
+  * and the kernel spreads incoming connections across them. Multiple reactors are
+  * not available on Windows.
+  */
+  HttpSimpleServer(int reactorCount = 1);
   ~HttpSimpleServer();
   void Init(const char * httpServerAddress, int httpServerPort, const char * offerPath);
   void Run();
@@ -45,14 +56,30 @@ public:
   static void SetPeerConnectionFactory(PcFactory* pcFactory);
 
 private:
-  event_base* _evtBase;
-  evhttp* _httpSvr;
+  struct Reactor {
+    event_base* evtBase;
+    evhttp* httpSvr;
+    std::thread thread;
+  };
+
+  /* An answer produced on a peer connection signaling thread that needs to be sent
+  * back on the event_base thread that owns the request.
+  */
+  struct PendingReply {
+    evhttp_request* req;
+    PcOutcome outcome;
+    std::string answer;
+  };
+
+  std::vector<std::unique_ptr<Reactor>> _reactors;
   event* _signalEvent;
   bool _isDisposed;
   
   static PcFactory* _pcFactory;
 
   static void OnHttpRequest(struct evhttp_request* req, void* arg);
+  static void OnMetricsRequest(struct evhttp_request* req, void* arg);
+  static void OnAnswer(evutil_socket_t fd, short events, void* arg);
   static void OnSignal(evutil_socket_t sig, short events, void* user_data);
 };
 
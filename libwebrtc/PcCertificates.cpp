@@ -0,0 +1,105 @@
+/******************************************************************************
+* Filename: PcCertificates.cpp
+*
+* Description: See header file.
+*
+* License: Public Domain (no warranty, use at own risk)
+/******************************************************************************/
+
+#include "PcCertificates.h"
+#include "AsyncLogger.h"
+
+#include <rtc_base/rtc_certificate_generator.h>
+#include <rtc_base/ssl_identity.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+PcCertificates::PcCertificates(size_t count, PcCertificateType type, std::chrono::seconds rotationInterval) :
+  _type(type),
+  _rotationInterval(rotationInterval),
+  _next(0),
+  _stopping(false),
+  _generatedCount(0),
+  _generationTimeNanoseconds(0)
+{
+  if (rotationInterval.count() <= 0 || rotationInterval.count() > MAX_CERTIFICATE_ROTATION_SECONDS) {
+    throw std::runtime_error("PcCertificates rotation interval of " + std::to_string(rotationInterval.count()) + "s is out of range.");
+  }
+
+  for (size_t i = 0; i < std::max<size_t>(count, 1); i++) {
+    auto certificate = Generate();
+    if (!certificate) {
+      throw std::runtime_error("PcCertificates failed to generate a DTLS certificate.");
+    }
+    _certificates.push_back(certificate);
+  }
+
+  ECHO_LOG_INFO("Generated " << _certificates.size() << " " << (type == PcCertificateType::Rsa ? "RSA" : "ECDSA")
+    << " DTLS certificate(s) in " << std::chrono::duration_cast<std::chrono::milliseconds>(GetGenerationTime()).count()
+    << "ms, rotation every " << rotationInterval.count() << "s.");
+
+  _rotationThread = std::thread([this]() { Rotate(); });
+}
+
+PcCertificates::~PcCertificates()
+{
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stopping = true;
+  }
+  _stopCondition.notify_all();
+
+  if (_rotationThread.joinable()) {
+    _rotationThread.join();
+  }
+}
+
+rtc::scoped_refptr<rtc::RTCCertificate> PcCertificates::Next()
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto certificate = _certificates[_next];
+  _next = (_next + 1) % _certificates.size();
+  return certificate;
+}
+
+rtc::scoped_refptr<rtc::RTCCertificate> PcCertificates::Generate()
+{
+  auto start = std::chrono::steady_clock::now();
+
+  auto keyParams = _type == PcCertificateType::Rsa ? rtc::KeyParams::RSA() : rtc::KeyParams::ECDSA();
+  auto certificate = rtc::RTCCertificateGenerator::GenerateCertificate(keyParams, std::nullopt);
+
+  _generationTimeNanoseconds.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+  _generatedCount.fetch_add(1, std::memory_order_relaxed);
+
+  return certificate;
+}
+
+/**
+* Replaces one certificate every rotation interval divided by the number of
+* certificates. Key generation happens outside the lock so Next() is never held
+* up, peer connections already using an old certificate keep a reference to it.
+*/
+void PcCertificates::Rotate()
+{
+  auto period = std::chrono::duration_cast<std::chrono::milliseconds>(_rotationInterval) / _certificates.size();
+  size_t slot = 0;
+
+  std::unique_lock<std::mutex> lock(_mutex);
+  while (!_stopCondition.wait_for(lock, period, [this]() { return _stopping; })) {
+    lock.unlock();
+    auto certificate = Generate();
+    lock.lock();
+
+    if (certificate) {
+      _certificates[slot] = certificate;
+      slot = (slot + 1) % _certificates.size();
+    }
+    else {
+      ECHO_LOG_WARNING("Failed to generate a replacement DTLS certificate.");
+    }
+  }
+}
@@ -0,0 +1,74 @@
+/******************************************************************************
+* Filename: PcCertificates.h
+*
+* Description:
+* A small set of pre-generated DTLS certificates handed out to new peer
+* connections. Without them libwebrtc generates a key pair for every peer
+* connection while answering the offer. A background thread replaces the
+* certificates one at a time so none is used for longer than the rotation
+* interval.
+*
+* License: Public Domain (no warranty, use at own risk)
+/******************************************************************************/
+
+#ifndef __PEER_CONNECTION_CERTIFICATES__
+#define __PEER_CONNECTION_CERTIFICATES__
+
+#include <api/scoped_refptr.h>
+#include <rtc_base/rtc_certificate.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define DEFAULT_CERTIFICATE_COUNT 4
+#define DEFAULT_CERTIFICATE_ROTATION_SECONDS 86400
+// libwebrtc certificates expire after 30 days, a day short of that leaves a margin.
+#define MAX_CERTIFICATE_ROTATION_SECONDS (29 * 86400)
+
+enum class PcCertificateType {
+  Ecdsa,
+  Rsa
+};
+
+class PcCertificates {
+public:
+  /* Generates the initial certificates on the calling thread so they're ready
+  * before the first offer. The rotation interval must be from one second up to
+  * MAX_CERTIFICATE_ROTATION_SECONDS so a certificate is replaced before it expires.
+  */
+  PcCertificates(size_t count, PcCertificateType type, std::chrono::seconds rotationInterval);
+  ~PcCertificates();
+
+  /* Returns the certificates in turn. Thread safe. */
+  rtc::scoped_refptr<rtc::RTCCertificate> Next();
+
+  uint64_t GetGeneratedCount() const { return _generatedCount.load(std::memory_order_relaxed); }
+  std::chrono::nanoseconds GetGenerationTime() const {
+    return std::chrono::nanoseconds(_generationTimeNanoseconds.load(std::memory_order_relaxed));
+  }
+
+private:
+  rtc::scoped_refptr<rtc::RTCCertificate> Generate();
+  void Rotate();
+
+  const PcCertificateType _type;
+  const std::chrono::seconds _rotationInterval;
+
+  std::mutex _mutex;
+  std::vector<rtc::scoped_refptr<rtc::RTCCertificate>> _certificates;
+  size_t _next;
+
+  std::condition_variable _stopCondition;
+  bool _stopping;
+  std::thread _rotationThread;
+
+  std::atomic<uint64_t> _generatedCount;
+  std::atomic<uint64_t> _generationTimeNanoseconds;
+};
+
+#endif
@@ -14,6 +14,7 @@
 /******************************************************************************/
 
 #include "PcFactory.h"
+#include "AsyncLogger.h"
 #include "json.hpp"
 
 #include "api/audio/audio_processing.h"
@@ -32,7 +33,9 @@
 #include <api/peer_connection_interface.h>
 #include <api/rtc_event_log/rtc_event_log_factory.h>
 #include <api/task_queue/default_task_queue_factory.h>
+#include "api/units/time_delta.h"
 #include <media/engine/webrtc_media_engine.h>
+#include <p2p/base/port_allocator.h>
 #include "api/enable_media.h"
 #include "fake_audio_capture_module.h"
 #include <api/video_codecs/video_decoder_factory_template.h>
@@ -42,167 +45,510 @@
 #include <api/video_codecs/video_decoder_factory_template_libvpx_vp9_adapter.h>
 #include <api/video_codecs/video_encoder_factory_template_libvpx_vp9_adapter.h>
 
+#include <algorithm>
+#include <filesystem>
 #include <iostream>
 #include <sstream>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
 
 // Number of seconds to wait for the remote SDP offer to be set on the peer connection.
 #define SET_REMOTE_SDP_TIMEOUT_SECONDS 3
 
-PcFactory::PcFactory() :
-  _peerConnections()
+PcFactory::PcFactory(size_t maxPeerConnections, size_t shardCount, PcShardPolicy shardPolicy, bool cacheAudioTrack,
+  const FakeAudioCaptureModule::Options& audioOptions, PcCertificates* certificates, const PcIceOptions& iceOptions) :
+  _shardPolicy(shardPolicy),
+  _cacheAudioTrack(cacheAudioTrack),
+  _audioOptions(audioOptions),
+  _certificates(certificates),
+  _iceOptions(iceOptions),
+  _nextShard(0),
+  _isShutdown(false),
+  _peerConnections(),
+  _nextPeerConnectionId(0),
+  _maxPeerConnections(maxPeerConnections),
+  _peakPeerConnections(0)
 {
-  std::cout << "PcFactory initialise on " << std::this_thread::get_id() << std::endl;
+  ECHO_LOG_INFO("PcFactory initialise on " << std::this_thread::get_id() << " with " << shardCount << " shard(s), audio track cache "
+    << (cacheAudioTrack ? "on" : "off") << ", audio " << audioOptions.sample_rate << "Hz " << audioOptions.channels << " channel(s)"
+    << (audioOptions.loopback ? " loopback" : "") << ".");
+
+  if (iceOptions.minPort > 0) {
+    ECHO_LOG_INFO("ICE ports " << iceOptions.minPort << " to " << iceOptions.maxPort
+      << (iceOptions.udpOnly ? ", UDP host candidates only" : "") << (iceOptions.defaultRouteOnly ? ", default route only" : "") << ".");
+
+    // Each peer connection needs a port of its own for every network it gathers on.
+    if (static_cast<size_t>(iceOptions.maxPort - iceOptions.minPort + 1) < maxPeerConnections) {
+      ECHO_LOG_WARNING("The ICE port range is smaller than the limit of " << maxPeerConnections
+        << " peer connections, connections beyond it will have no candidates.");
+    }
+  }
 
-  SignalingThread = rtc::Thread::Create();
-  SignalingThread->Start();
+  for (size_t i = 0; i < std::max<size_t>(shardCount, 1); i++) {
+    _shards.push_back(CreateShard(i));
+  }
+}
+
+PcFactory::~PcFactory()
+{
+  Shutdown();
+}
+
+void PcFactory::Shutdown()
+{
+  if (_isShutdown.exchange(true)) {
+    return;
+  }
+
+  std::unordered_map<uint64_t, PcEntry> peerConnections;
+  {
+    std::lock_guard<std::mutex> lock(_peerConnectionsMutex);
+    peerConnections.swap(_peerConnections);
+  }
+
+  for (auto& [id, entry] : peerConnections) {
+    if (entry.pc) {
+      entry.pc->Close();
+    }
+  }
+  peerConnections.clear();
+
+  /* Any removal tasks still queued will find an empty table. Stopping the signaling
+  * thread discards the answer timeouts and anything else still queued on it.
+  */
+  for (auto& shard : _shards) {
+    shard->AudioTrack = nullptr;
+    shard->AudioDevice = nullptr;
+    shard->PeerConnectionFactory = nullptr;
+    shard->SignalingThread->Stop();
+    shard->WorkerThread->Stop();
+    shard->NetworkThread->Stop();
+  }
+}
+
+std::unique_ptr<PcFactory::PcShard> PcFactory::CreateShard(size_t index)
+{
+  auto shard = std::make_unique<PcShard>();
+
+  shard->SignalingThread = rtc::Thread::Create();
+  shard->SignalingThread->SetName("pc_signaling_" + std::to_string(index), nullptr);
+  shard->SignalingThread->Start();
+
+  shard->NetworkThread = rtc::Thread::CreateWithSocketServer();
+  shard->NetworkThread->SetName("pc_network_" + std::to_string(index), nullptr);
+  shard->NetworkThread->Start();
+
+  shard->WorkerThread = rtc::Thread::Create();
+  shard->WorkerThread->SetName("pc_worker_" + std::to_string(index), nullptr);
+  shard->WorkerThread->Start();
 
   webrtc::AudioProcessing::Config apmConfig;
   apmConfig.gain_controller1.enabled = false;
   apmConfig.gain_controller2.enabled = false;
   auto apm = webrtc::BuiltinAudioProcessingBuilder(apmConfig).Build(webrtc::CreateEnvironment());
 
-   webrtc::PeerConnectionFactoryDependencies _pcf_deps;
+  webrtc::PeerConnectionFactoryDependencies _pcf_deps;
   _pcf_deps.task_queue_factory = webrtc::CreateDefaultTaskQueueFactory();
-  _pcf_deps.signaling_thread = SignalingThread.get();
+  _pcf_deps.signaling_thread = shard->SignalingThread.get();
+  _pcf_deps.network_thread = shard->NetworkThread.get();
+  _pcf_deps.worker_thread = shard->WorkerThread.get();
   _pcf_deps.event_log_factory = std::make_unique<webrtc::RtcEventLogFactory>(_pcf_deps.task_queue_factory.get());
   _pcf_deps.audio_encoder_factory = webrtc::CreateBuiltinAudioEncoderFactory();
   _pcf_deps.audio_decoder_factory = webrtc::CreateBuiltinAudioDecoderFactory();
   _pcf_deps.video_encoder_factory = std::make_unique<webrtc::VideoEncoderFactoryTemplate<webrtc::LibvpxVp8EncoderTemplateAdapter>>();
   _pcf_deps.video_decoder_factory = std::make_unique<webrtc::VideoDecoderFactoryTemplate<webrtc::LibvpxVp8DecoderTemplateAdapter>>();
-  _pcf_deps.adm = rtc::scoped_refptr<webrtc::AudioDeviceModule>(FakeAudioCaptureModule::Create());
+  shard->AudioDevice = FakeAudioCaptureModule::Create(_audioOptions);
+  if (!shard->AudioDevice) {
+    throw std::runtime_error("PcFactory unsupported audio format " + std::to_string(_audioOptions.sample_rate) + "Hz "
+      + std::to_string(_audioOptions.channels) + " channel(s).");
+  }
+  _pcf_deps.adm = shard->AudioDevice;
   _pcf_deps.audio_processing = apm; // Gets moved in EnableMedia.
 
   webrtc::EnableMedia(_pcf_deps);
 
-  _peerConnectionFactory = webrtc::CreateModularPeerConnectionFactory(std::move(_pcf_deps));
+  shard->PeerConnectionFactory = webrtc::CreateModularPeerConnectionFactory(std::move(_pcf_deps));
+
+  if (_cacheAudioTrack) {
+    shard->AudioTrack = CreateAudioTrack(*shard);
+    if (!shard->AudioTrack) {
+      throw std::runtime_error("PcFactory failed to create the cached audio track for shard " + std::to_string(index) + ".");
+    }
+  }
+
+  return shard;
 }
 
-PcFactory::~PcFactory()
+rtc::scoped_refptr<webrtc::AudioTrackInterface> PcFactory::CreateAudioTrack(PcShard& shard)
+{
+  // Create a local audio source
+  rtc::scoped_refptr<webrtc::AudioSourceInterface> audio_source =
+    shard.PeerConnectionFactory->CreateAudioSource(cricket::AudioOptions());
+
+  // Create a local audio track
+  return shard.PeerConnectionFactory->CreateAudioTrack("audio_label", audio_source.get());
+}
+
+/**
+* Picks the shard for a new peer connection. Round robin spreads offers evenly
+* while least loaded favours shards whose connections have been closed. Audio
+* loopback always takes the least loaded shard since it needs an idle one.
+*/
+size_t PcFactory::SelectShard()
+{
+  if (_shardPolicy == PcShardPolicy::LeastLoaded || _audioOptions.loopback) {
+    size_t selected = 0;
+    for (size_t i = 1; i < _shards.size(); i++) {
+      if (_shards[i]->LiveCount < _shards[selected]->LiveCount) {
+        selected = i;
+      }
+    }
+    return selected;
+  }
+  else {
+    return _nextShard++ % _shards.size();
+  }
+}
+
+size_t PcFactory::GetLiveCount() {
+  std::lock_guard<std::mutex> lock(_peerConnectionsMutex);
+  return _peerConnections.size();
+}
+
+size_t PcFactory::GetPeakCount() {
+  std::lock_guard<std::mutex> lock(_peerConnectionsMutex);
+  return _peakPeerConnections;
+}
+
+std::string PcFactory::GetMetrics() {
+  if (_isShutdown) {
+    return std::string();
+  }
+
+  size_t liveCount = 0, peakCount = 0;
+  {
+    std::lock_guard<std::mutex> lock(_peerConnectionsMutex);
+    liveCount = _peerConnections.size();
+    peakCount = _peakPeerConnections;
+  }
+
+  auto clock = FakeAudioCaptureModule::GetClockStats();
+  auto loopback = FakeAudioCaptureModule::GetLoopbackStats();
+
+  std::ostringstream out;
+  out << _metrics.ToPrometheus(liveCount, peakCount);
+  if (_certificates) {
+    out << "# HELP webrtc_echo_certificates_generated_total DTLS certificates generated for the shared set.\n";
+    out << "# TYPE webrtc_echo_certificates_generated_total counter\n";
+    out << "webrtc_echo_certificates_generated_total " << _certificates->GetGeneratedCount() << "\n";
+    out << "# HELP webrtc_echo_certificate_generation_seconds_total Time spent generating the shared DTLS certificates.\n";
+    out << "# TYPE webrtc_echo_certificate_generation_seconds_total counter\n";
+    out << "webrtc_echo_certificate_generation_seconds_total "
+      << std::chrono::duration<double>(_certificates->GetGenerationTime()).count() << "\n";
+  }
+#ifndef _WIN32
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    double cpuSeconds = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    out << "# HELP process_cpu_seconds_total Total user and system CPU time spent in seconds.\n";
+    out << "# TYPE process_cpu_seconds_total counter\n";
+    out << "process_cpu_seconds_total " << cpuSeconds << "\n";
+  }
+#endif
+#ifdef __linux__
+  std::error_code fdError;
+  std::filesystem::directory_iterator fds("/proc/self/fd", fdError);
+  if (!fdError) {
+    out << "# HELP process_open_fds Number of open file descriptors.\n";
+    out << "# TYPE process_open_fds gauge\n";
+    out << "process_open_fds " << std::distance(fds, std::filesystem::directory_iterator()) << "\n";
+  }
+#endif
+  out << "# HELP webrtc_echo_audio_clock_modules Audio devices being paced by the audio clock thread.\n";
+  out << "# TYPE webrtc_echo_audio_clock_modules gauge\n";
+  out << "webrtc_echo_audio_clock_modules " << clock.modules << "\n";
+  out << "# HELP webrtc_echo_audio_clock_ticks_total 10ms audio clock ticks.\n";
+  out << "# TYPE webrtc_echo_audio_clock_ticks_total counter\n";
+  out << "webrtc_echo_audio_clock_ticks_total " << clock.ticks << "\n";
+  out << "# HELP webrtc_echo_audio_clock_late_ticks_total Audio clock ticks that started a frame or more late.\n";
+  out << "# TYPE webrtc_echo_audio_clock_late_ticks_total counter\n";
+  out << "webrtc_echo_audio_clock_late_ticks_total " << clock.late_ticks << "\n";
+  out << "# HELP webrtc_echo_audio_clock_busy_seconds_total Time the audio clock thread spent pushing and pulling frames.\n";
+  out << "# TYPE webrtc_echo_audio_clock_busy_seconds_total counter\n";
+  out << "webrtc_echo_audio_clock_busy_seconds_total " << clock.busy_time_us / 1e6 << "\n";
+  out << "# HELP webrtc_echo_audio_loopback_frames_total Playout frames sent back in audio loopback mode.\n";
+  out << "# TYPE webrtc_echo_audio_loopback_frames_total counter\n";
+  out << "webrtc_echo_audio_loopback_frames_total " << loopback.frames << "\n";
+  out << "# HELP webrtc_echo_audio_loopback_underruns_total Recorded frames sent as silence because no playout frame was waiting.\n";
+  out << "# TYPE webrtc_echo_audio_loopback_underruns_total counter\n";
+  out << "webrtc_echo_audio_loopback_underruns_total " << loopback.underruns << "\n";
+  out << "# HELP webrtc_echo_audio_loopback_overruns_total Playout frames dropped because the loopback ring was full.\n";
+  out << "# TYPE webrtc_echo_audio_loopback_overruns_total counter\n";
+  out << "webrtc_echo_audio_loopback_overruns_total " << loopback.overruns << "\n";
+  out << "# HELP webrtc_echo_audio_loopback_delay_seconds Time from a frame being pulled for playout to it being sent back.\n";
+  out << "# TYPE webrtc_echo_audio_loopback_delay_seconds summary\n";
+  out << "webrtc_echo_audio_loopback_delay_seconds_sum " << loopback.delay_time_us / 1e6 << "\n";
+  out << "webrtc_echo_audio_loopback_delay_seconds_count " << loopback.frames << "\n";
+
+  // The fake audio device mixes the playout of all the peer connections on a shard.
+  std::vector<FakeAudioCaptureModule::PlayoutStats> playout;
+  for (auto& shard : _shards) {
+    playout.push_back(shard->AudioDevice->GetPlayoutStats());
+  }
+  auto writePlayout = [&](const char* name, const char* type, const char* help, auto value) {
+    out << "# HELP " << name << " " << help << "\n";
+    out << "# TYPE " << name << " " << type << "\n";
+    for (size_t i = 0; i < playout.size(); i++) {
+      out << name << "{shard=\"" << i << "\"} " << value(playout[i]) << "\n";
+    }
+  };
+  writePlayout("webrtc_echo_audio_playout_frames_total", "counter", "Audio frames pulled for playout.",
+    [](auto& stats) { return stats.frames; });
+  writePlayout("webrtc_echo_audio_playout_tone_frames_total", "counter", "Playout frames containing the tone sent by the fake audio device.",
+    [](auto& stats) { return stats.tone_frames; });
+  writePlayout("webrtc_echo_audio_playout_samples_total", "counter", "Audio samples pulled for playout.",
+    [](auto& stats) { return stats.samples; });
+  writePlayout("webrtc_echo_audio_playout_clipped_samples_total", "counter", "Playout samples at full scale.",
+    [](auto& stats) { return stats.clipped_samples; });
+  writePlayout("webrtc_echo_audio_playout_energy_total", "counter", "Sum of the squared playout samples with full scale as 1, the RMS level is sqrt(rate(energy) / rate(samples)).",
+    [](auto& stats) { return stats.energy; });
+  writePlayout("webrtc_echo_audio_playout_peak", "gauge", "Largest absolute sample in the last playout frame.",
+    [](auto& stats) { return stats.last_peak; });
+  return out.str();
+}
+
+/**
+* Called from the peer connection observer on the signaling thread. Connections
+* that have reached a terminal state are removed from the table. The removal is
+* posted rather than done inline since the peer connection cannot be closed from
+* within one of its own observer callbacks.
+*/
+void PcFactory::OnConnectionChange(uint64_t id, size_t shard, webrtc::PeerConnectionInterface::PeerConnectionState state)
 {
-  for (auto pc : _peerConnections) {
-    pc->Close();
+  if (state == webrtc::PeerConnectionInterface::PeerConnectionState::kClosed ||
+    state == webrtc::PeerConnectionInterface::PeerConnectionState::kFailed ||
+    state == webrtc::PeerConnectionInterface::PeerConnectionState::kDisconnected) {
+    _shards[shard]->SignalingThread->PostTask([this, id]() { RemovePeerConnection(id); });
   }
-  _peerConnections.clear();
-  _peerConnectionFactory = nullptr;
 }
 
-std::string PcFactory::CreatePeerConnection(const char* buffer, int length) {
+void PcFactory::RemovePeerConnection(uint64_t id)
+{
+  PcEntry entry;
+  size_t liveCount = 0;
+  {
+    std::lock_guard<std::mutex> lock(_peerConnectionsMutex);
+    auto it = _peerConnections.find(id);
+    if (it == _peerConnections.end()) {
+      return;
+    }
+    entry = std::move(it->second);
+    _peerConnections.erase(it);
+    liveCount = _peerConnections.size();
+  }
 
-  std::string offerStr(buffer, length);
+  // Close detaches the observer so it's safe for it to be released with the entry.
+  if (entry.pc) {
+    entry.pc->Close();
+  }
 
-  std::cout << offerStr << std::endl;
+  // Only counted out once closed so a loopback shard is never shared, even briefly.
+  _shards[entry.shard]->LiveCount--;
 
-  auto offerJson = nlohmann::json::parse(offerStr);
+  ECHO_LOG_DEBUG("Peer connection " << id << " removed from shard " << entry.shard << ", live " << liveCount << ".");
+}
 
-  //std::cout << "CreatePeerConnection on thread " << std::this_thread::get_id() << " supplied with offer : " << std::endl << offerJson.dump() << std::endl;
-  std::cout << "CreatePeerConnection on thread " << std::this_thread::get_id() << " supplied with offer : " << std::endl;
+void PcFactory::CreatePeerConnection(std::string_view offer, AnswerCallback onAnswer) {
 
-  webrtc::PeerConnectionInterface::RTCConfiguration config;
-  config.sdp_semantics = webrtc::SdpSemantics::kUnifiedPlan;
-  //config.media_config.audio = new cricket::MediaConfig::Audio();
-  //config.continual_gathering_policy = webrtc::PeerConnectionInterface::ContinualGatheringPolicy::GATHER_ONCE;
-  
-  auto dependencies = webrtc::PeerConnectionDependencies(new PcObserver());
+  /* Only marked on this thread until the offer is posted, and after that only on
+  * the shard's signaling thread, so it doesn't need any locking.
+  */
+  auto timer = std::make_shared<PcTimer>();
 
-  auto pcOrError = _peerConnectionFactory->CreatePeerConnectionOrError(config, std::move(dependencies));
+  ECHO_LOG_SDP("Offer: " << offer);
 
-  rtc::scoped_refptr<webrtc::PeerConnectionInterface> pc = nullptr;
+  // Parsed straight from the request body, the SDP string is the only copy made.
+  auto offerJson = nlohmann::json::parse(offer.begin(), offer.end(), nullptr, false);
+  auto sdpField = offerJson.is_object() ? offerJson.find("sdp") : offerJson.end();
 
-  if (!pcOrError.ok()) {
-    std::cerr << "Failed to get peer connection from factory. " << pcOrError.error().message() << std::endl;
-    return "error";
+  if (offerJson.is_discarded() || sdpField == offerJson.end() || !sdpField->is_string()) {
+    ECHO_LOG_WARNING("Failed to parse the JSON offer.");
+    _metrics.Record(*timer, PcOutcome::Invalid);
+    onAnswer(PcOutcome::Invalid, std::string());
+    return;
   }
-  else {
-    pc = pcOrError.MoveValue();
 
-    // Create a local audio source
-    rtc::scoped_refptr<webrtc::AudioSourceInterface> audio_source =
-      _peerConnectionFactory->CreateAudioSource(cricket::AudioOptions());
+  ECHO_LOG_DEBUG("CreatePeerConnection on thread " << std::this_thread::get_id() << ".");
+
+  if (_isShutdown) {
+    _metrics.Record(*timer, PcOutcome::Rejected);
+    onAnswer(PcOutcome::Rejected, std::string());
+    return;
+  }
+
+  uint64_t id = 0;
+  size_t shardIndex = 0;
+  PcObserver* observer = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(_peerConnectionsMutex);
+    if (_peerConnections.size() >= _maxPeerConnections) {
+      ECHO_LOG_WARNING("Peer connection limit of " << _maxPeerConnections << " reached, offer rejected.");
+      _metrics.Record(*timer, PcOutcome::Rejected);
+      onAnswer(PcOutcome::Rejected, std::string());
+      return;
+    }
+
+    /* The audio device on a shard mixes the playout of all its peer connections so
+    * with loopback a shard that's still in use would echo one caller to another.
+    */
+    shardIndex = SelectShard();
+    if (_audioOptions.loopback && _shards[shardIndex]->LiveCount > 0) {
+      ECHO_LOG_WARNING("No free shard for an audio loopback peer connection, offer rejected.");
+      _metrics.Record(*timer, PcOutcome::Rejected);
+      onAnswer(PcOutcome::Rejected, std::string());
+      return;
+    }
+
+    id = _nextPeerConnectionId++;
+    auto& entry = _peerConnections[id];
+    entry.shard = shardIndex;
+    entry.observer = std::make_unique<PcObserver>([this, id, shardIndex](webrtc::PeerConnectionInterface::PeerConnectionState state) {
+      OnConnectionChange(id, shardIndex, state);
+    });
+    _shards[shardIndex]->LiveCount++;
+    observer = entry.observer.get();
+    _peakPeerConnections = std::max(_peakPeerConnections, _peerConnections.size());
+  }
+  PcShard& shard = *_shards[shardIndex];
+
+  timer->Mark(PcPhase::ParseOffer);
+
+  // Whichever of the answer or the timeout happens first completes the offer.
+  auto isComplete = std::make_shared<std::atomic<bool>>(false);
+  auto complete = [this, id, &shard, isComplete, timer, onAnswer](const std::string& answer, PcOutcome outcome) {
+    if (!isComplete->exchange(true)) {
+      if (outcome != PcOutcome::Answered) {
+        shard.SignalingThread->PostTask([this, id]() { RemovePeerConnection(id); });
+      }
+      _metrics.Record(*timer, outcome);
+      onAnswer(outcome, answer);
+    }
+  };
+
+  shard.SignalingThread->PostDelayedTask([complete]() {
+    ECHO_LOG_WARNING("Timed out waiting for create answer.");
+    complete(std::string(), PcOutcome::TimedOut);
+    }, webrtc::TimeDelta::Seconds(SET_REMOTE_SDP_TIMEOUT_SECONDS));
+
+  shard.SignalingThread->PostTask([this, id, &shard, observer, timer, complete, offerSdp = std::move(sdpField->get_ref<std::string&>())]() {
+    timer->Mark(PcPhase::Queue);
+
+    webrtc::PeerConnectionInterface::RTCConfiguration config;
+    config.sdp_semantics = webrtc::SdpSemantics::kUnifiedPlan;
+    if (_certificates) {
+      // Otherwise a key pair is generated for every peer connection.
+      config.certificates.push_back(_certificates->Next());
+    }
+    config.port_allocator_config.min_port = _iceOptions.minPort;
+    config.port_allocator_config.max_port = _iceOptions.maxPort;
+    if (_iceOptions.udpOnly) {
+      // The echo server has no STUN or TURN servers, so only host candidates are of any use.
+      config.tcp_candidate_policy = webrtc::PeerConnectionInterface::kTcpCandidatePolicyDisabled;
+      config.port_allocator_config.flags |= cricket::PORTALLOCATOR_DISABLE_TCP | cricket::PORTALLOCATOR_DISABLE_STUN |
+        cricket::PORTALLOCATOR_DISABLE_RELAY;
+    }
+    if (_iceOptions.defaultRouteOnly) {
+      config.port_allocator_config.flags |= cricket::PORTALLOCATOR_DISABLE_ADAPTER_ENUMERATION;
+    }
+    //config.media_config.audio = new cricket::MediaConfig::Audio();
+    //config.continual_gathering_policy = webrtc::PeerConnectionInterface::ContinualGatheringPolicy::GATHER_ONCE;
+
+    auto dependencies = webrtc::PeerConnectionDependencies(observer);
+
+    auto pcOrError = shard.PeerConnectionFactory->CreatePeerConnectionOrError(config, std::move(dependencies));
+
+    if (!pcOrError.ok()) {
+      ECHO_LOG_ERROR("Failed to get peer connection from factory. " << pcOrError.error().message());
+      complete(std::string(), PcOutcome::Failed);
+      return;
+    }
+
+    rtc::scoped_refptr<webrtc::PeerConnectionInterface> pc = pcOrError.MoveValue();
+    timer->Mark(PcPhase::CreatePeerConnection);
+
+    {
+      std::lock_guard<std::mutex> lock(_peerConnectionsMutex);
+      auto it = _peerConnections.find(id);
+      if (it != _peerConnections.end()) {
+        it->second.pc = pc;
+      }
+    }
 
-    // Create a local audio track
     rtc::scoped_refptr<webrtc::AudioTrackInterface> audio_track =
-      _peerConnectionFactory->CreateAudioTrack("audio_label", audio_source.get());
+      shard.AudioTrack ? shard.AudioTrack : CreateAudioTrack(shard);
 
     if (!audio_track) {
-      std::cerr << "Failed to create AudioTrack." << std::endl;
-      return "error";
+      ECHO_LOG_ERROR("Failed to create AudioTrack.");
+      complete(std::string(), PcOutcome::Failed);
+      return;
     }
 
-    std::cout << "AudioTrack created successfully." << std::endl;
+    ECHO_LOG_DEBUG("AudioTrack created successfully.");
 
     auto sender = pc->AddTrack(audio_track, { "stream_id" });
 
     if (!sender.ok()) {
-      std::cerr << "Failed to add AudioTrack to PeerConnection." << std::endl;
-      return "error";
+      ECHO_LOG_ERROR("Failed to add AudioTrack to PeerConnection.");
+      complete(std::string(), PcOutcome::Failed);
+      return;
     }
 
-    std::cout << "AudioTrack added to PeerConnection successfully." << std::endl;
+    ECHO_LOG_DEBUG("AudioTrack added to PeerConnection successfully.");
+    timer->Mark(PcPhase::CreateAudioTrack);
 
     //webrtc::DataChannelInit config;
     //auto dc = pc->CreateDataChannel("data_channel", &config);
 
-    _peerConnections.push_back(pc);
-
     webrtc::SdpParseError sdpError;
-    auto remoteOffer = webrtc::CreateSessionDescription(webrtc::SdpType::kOffer, offerJson["sdp"], &sdpError);
+    auto remoteOffer = webrtc::CreateSessionDescription(webrtc::SdpType::kOffer, offerSdp, &sdpError);
 
     if (remoteOffer == nullptr) {
-      std::cerr << "Failed to get parse remote SDP. " << sdpError.description << std::endl;
-      return "error";
+      ECHO_LOG_WARNING("Failed to get parse remote SDP. " << sdpError.description);
+      complete(std::string(), PcOutcome::Invalid);
+      return;
     }
-    else {
-
-      std::mutex mtx;
-      std::condition_variable cv;
-      bool isReady = false;
-
-      SignalingThread->PostTask([&]() {
-        std::cout << "Setting remote description on peer connection, thread ID " << std::this_thread::get_id() << std::endl;
 
-        pc->SetRemoteDescription(remoteOffer->Clone(), SetRemoteSdpObserver::Create());
+    timer->Mark(PcPhase::ParseSdp);
 
-        std::cout << "SetLocalDescription on thread, thread ID " << std::this_thread::get_id() << std::endl;
-        pc->SetLocalDescription(CreateSdpObserver::Create(mtx, cv, isReady));
-      });
+    ECHO_LOG_DEBUG("Setting remote description on peer connection, thread ID " << std::this_thread::get_id());
 
-      std::unique_lock<std::mutex> lck(mtx);
+    pc->SetRemoteDescription(std::move(remoteOffer), SetRemoteSdpObserver::Create());
+    timer->Mark(PcPhase::SetRemoteDescription);
 
-      if (!isReady) {
-        std::cout << "Waiting for create answer to complete..." << std::endl;
-
-        bool completed = cv.wait_for(lck, std::chrono::seconds(SET_REMOTE_SDP_TIMEOUT_SECONDS), [&]() {
-          return isReady;
-          });
-
-        if (!completed) {
-          std::cout << "Timed out waiting for isReady." << std::endl;
-          return std::string();
-        }
-        else {
-          std::cout << "isReady is now true within 3s." << std::endl;
-        }
-      }
-      
+    ECHO_LOG_DEBUG("SetLocalDescription on thread, thread ID " << std::this_thread::get_id());
+    pc->SetLocalDescription(CreateSdpObserver::Create([pc, timer, complete](webrtc::RTCError error) {
       auto localDescription = pc->local_description();
+      timer->Mark(PcPhase::SetLocalDescription);
 
-      if (localDescription == nullptr) {
-        return "Failed to set local description.";
+      if (!error.ok() || localDescription == nullptr) {
+        ECHO_LOG_ERROR("Failed to set local description.");
+        complete(std::string(), PcOutcome::Failed);
       }
       else {
-        std::cout << "Create answer complete." << std::endl;
+        ECHO_LOG_DEBUG("Create answer complete.");
 
         std::string answerSdp;
         localDescription->ToString(&answerSdp);
 
-        std::cout << answerSdp << std::endl;
-
         nlohmann::json answerJson;
         answerJson["type"] = "answer";
         answerJson["sdp"] = answerSdp;
 
-        return answerJson.dump();
+        complete(answerJson.dump(), PcOutcome::Answered);
       }
-    }
-  }
+      }));
+    });
 }
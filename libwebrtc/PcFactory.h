@@ -17,7 +17,10 @@
 #ifndef __PEER_CONNECTION_FACTORY__
 #define __PEER_CONNECTION_FACTORY__
 
+#include "PcCertificates.h"
+#include "PcMetrics.h"
 #include "PcObserver.h"
+#include "fake_audio_capture_module.h"
 
 #include <api/peer_connection_interface.h>
 #include <api/scoped_refptr.h>
@@ -29,17 +32,78 @@
 #include "pc/media_factory.h"
 #include "rtc_base/checks.h"
 
+#include <atomic>
 #include <condition_variable>
+#include <cstdint>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
+// Default limit on the number of peer connections that can be live at once.
+#define DEFAULT_MAX_PEER_CONNECTIONS 1000
+
+// How new peer connections are assigned to a factory shard.
+enum class PcShardPolicy {
+  RoundRobin,
+  LeastLoaded
+};
+
+/* ICE gathering options applied to every peer connection. The port allocator of each
+* peer connection gathers with the network manager and packet socket factory of its
+* shard, which are shared by all the peer connections on the shard, so these options
+* only narrow the sockets each allocator opens with them. There's no UDP mux in the
+* libwebrtc allocator, each peer connection binds its own port from the range.
+*/
+struct PcIceOptions {
+  int minPort = 0; // 0 for any port.
+  int maxPort = 0;
+  bool udpOnly = false; // Host UDP candidates only, no TCP, STUN or relay ports.
+  bool defaultRouteOnly = false; // A single socket on the default route instead of one per interface.
+};
+
 class PcFactory {
 public:
-  PcFactory();
+  /* Each shard is an independent PeerConnectionFactory with its own signaling,
+  * network and worker threads. A single shard matches the original behaviour.
+  */
+  PcFactory(size_t maxPeerConnections = DEFAULT_MAX_PEER_CONNECTIONS,
+    size_t shardCount = 1,
+    PcShardPolicy shardPolicy = PcShardPolicy::RoundRobin,
+    bool cacheAudioTrack = true,
+    const FakeAudioCaptureModule::Options& audioOptions = FakeAudioCaptureModule::Options(),
+    PcCertificates* certificates = nullptr,
+    const PcIceOptions& iceOptions = PcIceOptions());
   ~PcFactory();
-  std::string CreatePeerConnection(const char* buffer, int length);
 
+  /* Closes every peer connection and stops the shard threads. Once it returns no
+  * answer callback is running or will be called, so whatever the callbacks post
+  * to can be freed. New offers are rejected from then on.
+  */
+  void Shutdown();
+
+  typedef std::function<void(PcOutcome, const std::string&)> AnswerCallback;
+
+  /* Starts creating a peer connection for the SDP offer and returns immediately. All
+  * of the peer connection work is done on the signaling thread of the selected shard
+  * and onAnswer is called from there, exactly once, with the outcome and, if it was
+  * answered, the JSON encoded SDP answer. For any other outcome the answer is empty.
+  */
+  void CreatePeerConnection(std::string_view offer, AnswerCallback onAnswer);
+
+  size_t GetLiveCount();
+  size_t GetPeakCount();
+  size_t GetShardCount() const { return _shards.size(); }
+
+  /* Per phase answer latency histograms and connection counts in the Prometheus
+  * text format.
+  */
+  std::string GetMetrics();
+
+private:
   /* The thread logic is now tricky. I was not able to get even a basic peer connection
   * example working on Windows in debug mode due to the failing thread checks, see
   * https://groups.google.com/u/2/g/discuss-webrtc/c/HG9hzDP2djA
@@ -48,12 +112,56 @@ public:
 // will create the necessary thread internally. If `signaling_thread` is null,
 // the PeerConnectionFactory will use the thread on which this method is called
 // as the signaling thread, wrapping it in an rtc::Thread object if needed.
+  * To avoid relying on any of that each shard creates and starts all three threads itself.
   */
-  std::unique_ptr<rtc::Thread> SignalingThread;
+  struct PcShard {
+    std::unique_ptr<rtc::Thread> SignalingThread;
+    std::unique_ptr<rtc::Thread> NetworkThread;
+    std::unique_ptr<rtc::Thread> WorkerThread;
+    rtc::scoped_refptr<webrtc::PeerConnectionFactoryInterface> PeerConnectionFactory;
+    rtc::scoped_refptr<FakeAudioCaptureModule> AudioDevice;
 
-private:
-  rtc::scoped_refptr<webrtc::PeerConnectionFactoryInterface> _peerConnectionFactory;
-  std::vector<rtc::scoped_refptr<webrtc::PeerConnectionInterface>> _peerConnections;
+    /* With the audio track cache one source and track are created along with the shard
+    * and every peer connection on the shard sends the same track. Each AddTrack still
+    * gets its own RtpSender so the peer connections stay independent.
+    */
+    rtc::scoped_refptr<webrtc::AudioTrackInterface> AudioTrack;
+
+    std::atomic<size_t> LiveCount{ 0 };
+  };
+
+  /* A live peer connection. The observer must outlive the peer connection's use of
+  * it so both are owned by the table entry and released together once Close has
+  * been called.
+  */
+  struct PcEntry {
+    size_t shard = 0;
+    rtc::scoped_refptr<webrtc::PeerConnectionInterface> pc;
+    std::unique_ptr<PcObserver> observer;
+  };
+
+  std::unique_ptr<PcShard> CreateShard(size_t index);
+  rtc::scoped_refptr<webrtc::AudioTrackInterface> CreateAudioTrack(PcShard& shard);
+  size_t SelectShard();
+  void OnConnectionChange(uint64_t id, size_t shard, webrtc::PeerConnectionInterface::PeerConnectionState state);
+  void RemovePeerConnection(uint64_t id);
+
+  std::vector<std::unique_ptr<PcShard>> _shards;
+  PcShardPolicy _shardPolicy;
+  bool _cacheAudioTrack;
+  FakeAudioCaptureModule::Options _audioOptions;
+  PcCertificates* _certificates;
+  PcIceOptions _iceOptions;
+  std::atomic<size_t> _nextShard;
+  std::atomic<bool> _isShutdown;
+
+  std::mutex _peerConnectionsMutex;
+  std::unordered_map<uint64_t, PcEntry> _peerConnections;
+  uint64_t _nextPeerConnectionId;
+  size_t _maxPeerConnections;
+  size_t _peakPeerConnections;
+
+  PcMetrics _metrics;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,120 @@
+/******************************************************************************
+* Filename: PcMetrics.cpp
+*
+* Description: See header file.
+*
+* License: Public Domain (no warranty, use at own risk)
+/******************************************************************************/
+
+#include "PcMetrics.h"
+
+#include <algorithm>
+
+void PcHistogram::Observe(std::chrono::steady_clock::duration duration)
+{
+  double seconds = std::chrono::duration<double>(duration).count();
+  size_t bucket = std::lower_bound(Bounds.begin(), Bounds.end(), seconds) - Bounds.begin();
+
+  _buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+  _count.fetch_add(1, std::memory_order_relaxed);
+  _sumNanoseconds.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count(),
+    std::memory_order_relaxed);
+}
+
+void PcHistogram::Write(std::ostringstream& out, const std::string& name, const std::string& labels) const
+{
+  uint64_t cumulative = 0;
+  for (size_t i = 0; i < Bounds.size(); i++) {
+    cumulative += _buckets[i].load(std::memory_order_relaxed);
+    out << name << "_bucket{" << labels << ",le=\"" << Bounds[i] << "\"} " << cumulative << "\n";
+  }
+  cumulative += _buckets[Bounds.size()].load(std::memory_order_relaxed);
+  out << name << "_bucket{" << labels << ",le=\"+Inf\"} " << cumulative << "\n";
+  out << name << "_sum{" << labels << "} " << _sumNanoseconds.load(std::memory_order_relaxed) / 1e9 << "\n";
+  out << name << "_count{" << labels << "} " << _count.load(std::memory_order_relaxed) << "\n";
+}
+
+PcTimer::PcTimer() :
+  _start(std::chrono::steady_clock::now()),
+  _last(_start)
+{ }
+
+void PcTimer::Mark(PcPhase phase)
+{
+  auto now = std::chrono::steady_clock::now();
+  _durations[static_cast<size_t>(phase)] = now - _last;
+  _marked[static_cast<size_t>(phase)] = true;
+  _last = now;
+}
+
+void PcMetrics::Record(const PcTimer& timer, PcOutcome outcome)
+{
+  for (size_t i = 0; i < static_cast<size_t>(PcPhase::Total); i++) {
+    if (timer._marked[i]) {
+      _phases[i].Observe(timer._durations[i]);
+    }
+  }
+  _phases[static_cast<size_t>(PcPhase::Total)].Observe(timer.Elapsed());
+
+  Count(outcome);
+}
+
+void PcMetrics::Count(PcOutcome outcome)
+{
+  _outcomes[static_cast<size_t>(outcome)].fetch_add(1, std::memory_order_relaxed);
+}
+
+std::string PcMetrics::ToPrometheus(size_t liveCount, size_t peakCount) const
+{
+  std::ostringstream out;
+
+  out << "# HELP webrtc_echo_answer_phase_seconds Time spent in each phase of answering an offer.\n";
+  out << "# TYPE webrtc_echo_answer_phase_seconds histogram\n";
+  for (size_t i = 0; i < _phases.size(); i++) {
+    _phases[i].Write(out, "webrtc_echo_answer_phase_seconds",
+      std::string("phase=\"") + PhaseName(static_cast<PcPhase>(i)) + "\"");
+  }
+
+  out << "# HELP webrtc_echo_offers_total Offers by outcome.\n";
+  out << "# TYPE webrtc_echo_offers_total counter\n";
+  for (size_t i = 0; i < _outcomes.size(); i++) {
+    out << "webrtc_echo_offers_total{outcome=\"" << OutcomeName(static_cast<PcOutcome>(i)) << "\"} "
+      << _outcomes[i].load(std::memory_order_relaxed) << "\n";
+  }
+
+  out << "# HELP webrtc_echo_peer_connections Live peer connections.\n";
+  out << "# TYPE webrtc_echo_peer_connections gauge\n";
+  out << "webrtc_echo_peer_connections " << liveCount << "\n";
+  out << "# HELP webrtc_echo_peer_connections_peak Peak number of live peer connections.\n";
+  out << "# TYPE webrtc_echo_peer_connections_peak gauge\n";
+  out << "webrtc_echo_peer_connections_peak " << peakCount << "\n";
+
+  return out.str();
+}
+
+const char* PcMetrics::PhaseName(PcPhase phase)
+{
+  switch (phase) {
+  case PcPhase::ParseOffer: return "parse_offer";
+  case PcPhase::Queue: return "queue";
+  case PcPhase::CreatePeerConnection: return "create_peer_connection";
+  case PcPhase::CreateAudioTrack: return "create_audio_track";
+  case PcPhase::ParseSdp: return "parse_sdp";
+  case PcPhase::SetRemoteDescription: return "set_remote_description";
+  case PcPhase::SetLocalDescription: return "set_local_description";
+  case PcPhase::Total: return "total";
+  default: return "unknown";
+  }
+}
+
+const char* PcMetrics::OutcomeName(PcOutcome outcome)
+{
+  switch (outcome) {
+  case PcOutcome::Answered: return "answered";
+  case PcOutcome::Rejected: return "rejected";
+  case PcOutcome::Invalid: return "invalid";
+  case PcOutcome::Failed: return "failed";
+  case PcOutcome::TimedOut: return "timed_out";
+  default: return "unknown";
+  }
+}
@@ -0,0 +1,99 @@
+/******************************************************************************
+* Filename: PcMetrics.h
+*
+* Description:
+* Timing histograms for the phases of answering an SDP offer, exported in the
+* Prometheus text format for the HTTP metrics endpoint.
+*
+* License: Public Domain (no warranty, use at own risk)
+/******************************************************************************/
+
+#ifndef __PEER_CONNECTION_METRICS__
+#define __PEER_CONNECTION_METRICS__
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <sstream>
+#include <string>
+
+// The phases of CreatePeerConnection in the order they happen.
+enum class PcPhase {
+  ParseOffer,         // JSON parse and peer connection slot reservation.
+  Queue,              // Waiting for the shard's signaling thread to pick up the offer.
+  CreatePeerConnection,
+  CreateAudioTrack,   // Audio source and track creation and AddTrack.
+  ParseSdp,
+  SetRemoteDescription,
+  SetLocalDescription, // From the call until the observer completes with the answer.
+  Total,
+  Count
+};
+
+// How an offer ended up being completed.
+enum class PcOutcome {
+  Answered,
+  Rejected,  // Live peer connection limit reached.
+  Invalid,   // The offer couldn't be parsed.
+  Failed,
+  TimedOut,
+  Count
+};
+
+/* A histogram with fixed, Prometheus style, cumulative buckets. Observations are
+* lock free so they can be recorded from any signaling thread.
+*/
+class PcHistogram {
+public:
+  static constexpr std::array<double, 16> Bounds = {
+    0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01,
+    0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5 };
+
+  void Observe(std::chrono::steady_clock::duration duration);
+  void Write(std::ostringstream& out, const std::string& name, const std::string& labels) const;
+
+private:
+  std::array<std::atomic<uint64_t>, Bounds.size() + 1> _buckets{};
+  std::atomic<uint64_t> _count{ 0 };
+  std::atomic<uint64_t> _sumNanoseconds{ 0 };
+};
+
+/* Monotonic timestamps for a single offer. Each Mark records the time since the
+* previous one against the phase that has just finished.
+*/
+class PcTimer {
+public:
+  PcTimer();
+
+  void Mark(PcPhase phase);
+  std::chrono::steady_clock::duration Get(PcPhase phase) const { return _durations[static_cast<size_t>(phase)]; }
+  std::chrono::steady_clock::duration Elapsed() const { return std::chrono::steady_clock::now() - _start; }
+
+private:
+  std::chrono::steady_clock::time_point _start;
+  std::chrono::steady_clock::time_point _last;
+  std::array<std::chrono::steady_clock::duration, static_cast<size_t>(PcPhase::Count)> _durations{};
+  std::array<bool, static_cast<size_t>(PcPhase::Count)> _marked{};
+
+  friend class PcMetrics;
+};
+
+class PcMetrics {
+public:
+  /* Adds the phases marked on the timer, plus the total, to the histograms. */
+  void Record(const PcTimer& timer, PcOutcome outcome);
+  void Count(PcOutcome outcome);
+
+  /* Prometheus text exposition of all the histograms and counters. */
+  std::string ToPrometheus(size_t liveCount, size_t peakCount) const;
+
+  static const char* PhaseName(PcPhase phase);
+  static const char* OutcomeName(PcOutcome outcome);
+
+private:
+  std::array<PcHistogram, static_cast<size_t>(PcPhase::Count)> _phases;
+  std::array<std::atomic<uint64_t>, static_cast<size_t>(PcOutcome::Count)> _outcomes{};
+};
+
+#endif
@@ -17,40 +17,48 @@
 
 #include <iostream>
 
+PcObserver::PcObserver(ConnectionChangeCallback onConnectionChange) :
+  _onConnectionChange(std::move(onConnectionChange))
+{ }
+
 void PcObserver::OnSignalingChange(webrtc::PeerConnectionInterface::SignalingState new_state)
 {
-  std::cout << "OnSignalingChange " << new_state << "." << std::endl;
+  ECHO_LOG_DEBUG("OnSignalingChange " << new_state << ".");
 }
 
 void PcObserver::OnDataChannel(rtc::scoped_refptr<webrtc::DataChannelInterface> data_channel)
 {
-  std::cout << "OnDataChannel " << data_channel->id() << "." << std::endl;
+  ECHO_LOG_DEBUG("OnDataChannel " << data_channel->id() << ".");
 }
 
 void PcObserver::OnIceGatheringChange(webrtc::PeerConnectionInterface::IceGatheringState new_state)
 {
-  std::cout << "OnIceGatheringChange " << new_state << "." << std::endl;
+  ECHO_LOG_DEBUG("OnIceGatheringChange " << new_state << ".");
 }
 
 void PcObserver::OnIceCandidate(const webrtc::IceCandidateInterface* candidate)
 {
-  std::cout << "OnIceCandidate " << candidate->candidate().ToString() << "." << std::endl;
+  ECHO_LOG_DEBUG("OnIceCandidate " << candidate->candidate().ToString() << ".");
 }
 
 void PcObserver::OnAddTrack(
   rtc::scoped_refptr<webrtc::RtpReceiverInterface> receiver,
   const std::vector<rtc::scoped_refptr<webrtc::MediaStreamInterface>>& streams)
 {
-  std::cout << "OnAddTrack." << std::endl;
+  ECHO_LOG_DEBUG("OnAddTrack.");
 }
 
 void PcObserver::OnTrack(rtc::scoped_refptr<webrtc::RtpTransceiverInterface> transceiver)
 {
-  std::cout << "OnTrack." << std::endl;
+  ECHO_LOG_DEBUG("OnTrack.");
 }
 
 void PcObserver::OnConnectionChange(
   webrtc::PeerConnectionInterface::PeerConnectionState new_state)
 {
-  std::cout << "OnConnectionChange to " << (int)new_state << "." << std::endl;
+  ECHO_LOG_DEBUG("OnConnectionChange to " << (int)new_state << ".");
+
+  if (_onConnectionChange) {
+    _onConnectionChange(new_state);
+  }
 }
\ No newline at end of file
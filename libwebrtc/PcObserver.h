@@ -17,9 +17,12 @@
 #ifndef __PEER_CONNECTION_OBSERVER__
 #define __PEER_CONNECTION_OBSERVER__
 
+#include "AsyncLogger.h"
+
 #include <api/peer_connection_interface.h>
 
 #include <condition_variable>
+#include <functional>
 #include <iomanip>
 #include <iostream>
 #include <mutex>
@@ -29,6 +32,11 @@ class PcObserver :
   public webrtc::PeerConnectionObserver
 { 
 public:
+  typedef std::function<void(webrtc::PeerConnectionInterface::PeerConnectionState)> ConnectionChangeCallback;
+
+  PcObserver() = default;
+  PcObserver(ConnectionChangeCallback onConnectionChange);
+
   void OnSignalingChange(webrtc::PeerConnectionInterface::SignalingState new_state);
   void OnDataChannel(rtc::scoped_refptr<webrtc::DataChannelInterface> data_channel);
   void OnIceGatheringChange(webrtc::PeerConnectionInterface::IceGatheringState new_state);
@@ -40,6 +48,9 @@ public:
     rtc::scoped_refptr<webrtc::RtpTransceiverInterface> transceiver);
   void OnConnectionChange(
     webrtc::PeerConnectionInterface::PeerConnectionState new_state);
+
+private:
+  ConnectionChangeCallback _onConnectionChange;
 };
 
 class SetRemoteSdpObserver :
@@ -52,7 +63,7 @@ public:
 
   void OnSetRemoteDescriptionComplete(webrtc::RTCError error)
   {
-    std::cout << "OnSetRemoteDescriptionComplete ok ? " << std::boolalpha << error.ok() << "." << std::endl;
+    ECHO_LOG_DEBUG("OnSetRemoteDescriptionComplete ok ? " << std::boolalpha << error.ok() << ".");
   }
 };
 
@@ -60,36 +71,33 @@ class CreateSdpObserver :
   public webrtc::SetLocalDescriptionObserverInterface
 {
 public:
+  typedef std::function<void(webrtc::RTCError)> CompleteCallback;
 
-  static rtc::scoped_refptr<CreateSdpObserver> Create(std::mutex& mtx, std::condition_variable& cv, bool& isReady) {
-    return rtc::scoped_refptr<CreateSdpObserver>(new rtc::RefCountedObject<CreateSdpObserver>(mtx, cv, isReady));
+  static rtc::scoped_refptr<CreateSdpObserver> Create(CompleteCallback onComplete) {
+    return rtc::scoped_refptr<CreateSdpObserver>(new rtc::RefCountedObject<CreateSdpObserver>(std::move(onComplete)));
   }
   
-  CreateSdpObserver(std::mutex& mtx, std::condition_variable& cv, bool& isReady)
-    : _mtx(mtx), _cv(cv), _isReady(isReady) {
-    std::cout << "CreateSdpObserver Constructor." << std::endl;
+  CreateSdpObserver(CompleteCallback onComplete)
+    : _onComplete(std::move(onComplete)) {
+    ECHO_LOG_DEBUG("CreateSdpObserver Constructor.");
   }
 
   ~CreateSdpObserver() {
-    std::cout << "CreateSdpObserver Destructor." << std::endl;
+    ECHO_LOG_DEBUG("CreateSdpObserver Destructor.");
   }
 
   void OnSetLocalDescriptionComplete(webrtc::RTCError error) {
-    std::cout << "OnSetLocalDescriptionComplete." << std::endl;
+    ECHO_LOG_DEBUG("OnSetLocalDescriptionComplete.");
 
     if (!error.ok()) {
-      std::cerr << "OnSetLocalDescription error. " << error.message() << std::endl;
+      ECHO_LOG_ERROR("OnSetLocalDescription error. " << error.message());
     }
 
-    std::unique_lock<std::mutex> lck(_mtx);
-    _isReady = true;
-    _cv.notify_all();
+    _onComplete(std::move(error));
   }
 
 private:
-  std::mutex& _mtx;
-  std::condition_variable& _cv;
-  bool& _isReady;
+  CompleteCallback _onComplete;
 };
 
 class SetRemoteDescriptionObserver : public webrtc::SetSessionDescriptionObserver {
@@ -100,15 +108,15 @@ public:
   }
 
   SetRemoteDescriptionObserver() {
-    std::cout << "SetRemoteDescriptionObserver Constructor." << std::endl;
+    ECHO_LOG_DEBUG("SetRemoteDescriptionObserver Constructor.");
   }
 
   void OnSuccess() override {
-    std::cout << "SetRemoteDescriptionObserver::OnSuccess" << std::endl;
+    ECHO_LOG_DEBUG("SetRemoteDescriptionObserver::OnSuccess");
   }
 
   void OnFailure(webrtc::RTCError error) override {
-    std::cerr << "SetRemoteDescriptionObserver::OnFailure: " << error.message() << std::endl;
+    ECHO_LOG_ERROR("SetRemoteDescriptionObserver::OnFailure: " << error.message());
   }
 };
 
@@ -120,11 +128,11 @@ public:
   }
 
   void OnSuccess() override {
-    std::cout << "SetLocalDescriptionObserver::OnSuccess" << std::endl;
+    ECHO_LOG_DEBUG("SetLocalDescriptionObserver::OnSuccess");
   }
 
   void OnFailure(webrtc::RTCError error) override {
-    std::cerr << "SetLocalDescriptionObserver::OnFailure: " << error.message() << std::endl;
+    ECHO_LOG_ERROR("SetLocalDescriptionObserver::OnFailure: " << error.message());
   }
 };
 
@@ -136,11 +144,11 @@ public:
   }
 
   void OnSuccess(webrtc::SessionDescriptionInterface* desc) override {
-    std::cout << "CreateAnswerObserver::OnSuccess" << std::endl;
+    ECHO_LOG_DEBUG("CreateAnswerObserver::OnSuccess");
   }
 
   void OnFailure(webrtc::RTCError error) override {
-    std::cerr << "CreateAnswerObserver::OnFailure: " << error.message() << std::endl;
+    ECHO_LOG_ERROR("CreateAnswerObserver::OnFailure: " << error.message());
   }
 };
 
@@ -30,12 +30,22 @@
 
 #include <string.h>
 
-#include "api/make_ref_counted.h"
-#include "api/units/time_delta.h"
-#include "rtc_base/time_utils.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <chrono>
+#include <condition_variable>
 #include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "api/make_ref_counted.h"
+#include "rtc_base/platform_thread_types.h"
 
-using ::webrtc::TimeDelta;
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
 
 // Audio sample value that is high enough that it doesn't occur naturally when
 // frames are being faked. E.g. NetEq will not generate this large sample value
@@ -44,15 +54,288 @@ using ::webrtc::TimeDelta;
 static const int kHighSampleValue = 10000;
 
 // Constants here are derived by running VoE using a real ADM.
-// The constants correspond to 10ms of mono audio at 44kHz.
 static const int kTimePerFrameMs = 10;
-static const uint8_t kNumberOfChannels = 1;
-static const int kSamplesPerSecond = 44000;
 static const int kTotalDelayMs = 0;
 static const int kClockDriftMs = 0;
 static const uint32_t kMaxVolume = 14392;
 
-FakeAudioCaptureModule::FakeAudioCaptureModule()
+// When the clock thread falls this many frames behind it gives up catching up
+// and restarts the schedule from now.
+static const int kMaxLateFrames = 5;
+
+// Per frame measurements of the samples pulled for playout.
+struct SampleAnalysis {
+  int peak = 0;              // Largest absolute sample, saturated to 32767.
+  uint64_t sum_squares = 0;
+  uint32_t clipped = 0;      // Samples at positive or negative full scale.
+  uint32_t at_or_above = 0;  // Samples >= the threshold, compared unsigned.
+};
+
+typedef void (*AnalyseSamplesFunction)(const int16_t* samples,
+                                       size_t count,
+                                       uint16_t threshold,
+                                       SampleAnalysis* result);
+
+static void AnalyseSamplesScalar(const int16_t* samples,
+                                 size_t count,
+                                 uint16_t threshold,
+                                 SampleAnalysis* result) {
+  for (size_t i = 0; i < count; ++i) {
+    const int sample = samples[i];
+    result->peak = std::max(result->peak, std::min(std::abs(sample), 32767));
+    result->sum_squares += static_cast<uint64_t>(sample * sample);
+    result->clipped += (sample == 32767 || sample == -32768) ? 1 : 0;
+    result->at_or_above += (static_cast<uint16_t>(sample) >= threshold) ? 1 : 0;
+  }
+}
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define FAKE_AUDIO_X86
+
+// SSE2 is part of the x86-64 baseline so needs no runtime check. It has no
+// unsigned 16 bit compare, x >= t is tested as saturating t - x == 0.
+static void AnalyseSamplesSse2(const int16_t* samples,
+                               size_t count,
+                               uint16_t threshold,
+                               SampleAnalysis* result) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i max_value = _mm_set1_epi16(32767);
+  const __m128i min_value = _mm_set1_epi16(-32768);
+  const __m128i threshold_value = _mm_set1_epi16(static_cast<int16_t>(threshold));
+  __m128i peak = zero;
+  __m128i sum_squares = zero;
+  __m128i clipped = zero;
+  __m128i at_or_above = zero;
+
+  // The 16 bit lane counters can't overflow for frames of less than 8 * 65535
+  // samples.
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(samples + i));
+    peak = _mm_max_epi16(peak, _mm_max_epi16(x, _mm_subs_epi16(zero, x)));
+    // Each pair sum is at most 2^31 so is correct when read as unsigned.
+    const __m128i squares = _mm_madd_epi16(x, x);
+    sum_squares = _mm_add_epi64(sum_squares, _mm_unpacklo_epi32(squares, zero));
+    sum_squares = _mm_add_epi64(sum_squares, _mm_unpackhi_epi32(squares, zero));
+    clipped = _mm_sub_epi16(clipped, _mm_or_si128(_mm_cmpeq_epi16(x, max_value),
+                                                  _mm_cmpeq_epi16(x, min_value)));
+    at_or_above = _mm_sub_epi16(at_or_above,
+      _mm_cmpeq_epi16(_mm_subs_epu16(threshold_value, x), zero));
+  }
+
+  alignas(16) int16_t peak_lanes[8];
+  alignas(16) uint64_t sum_lanes[2];
+  alignas(16) uint16_t clipped_lanes[8];
+  alignas(16) uint16_t at_or_above_lanes[8];
+  _mm_store_si128(reinterpret_cast<__m128i*>(peak_lanes), peak);
+  _mm_store_si128(reinterpret_cast<__m128i*>(sum_lanes), sum_squares);
+  _mm_store_si128(reinterpret_cast<__m128i*>(clipped_lanes), clipped);
+  _mm_store_si128(reinterpret_cast<__m128i*>(at_or_above_lanes), at_or_above);
+  for (int lane = 0; lane < 8; ++lane) {
+    result->peak = std::max<int>(result->peak, peak_lanes[lane]);
+    result->clipped += clipped_lanes[lane];
+    result->at_or_above += at_or_above_lanes[lane];
+  }
+  result->sum_squares += sum_lanes[0] + sum_lanes[1];
+
+  AnalyseSamplesScalar(samples + i, count - i, threshold, result);
+}
+
+#if defined(__GNUC__) || defined(__clang__) || defined(__AVX2__)
+#define FAKE_AUDIO_AVX2
+
+// Same as the SSE2 version with 16 samples per step. Built with a target
+// attribute on GCC and Clang so the rest of the file doesn't require AVX2, and
+// only selected when the CPU supports it.
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((target("avx2")))
+#endif
+static void AnalyseSamplesAvx2(const int16_t* samples,
+                               size_t count,
+                               uint16_t threshold,
+                               SampleAnalysis* result) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i max_value = _mm256_set1_epi16(32767);
+  const __m256i min_value = _mm256_set1_epi16(-32768);
+  const __m256i threshold_value = _mm256_set1_epi16(static_cast<int16_t>(threshold));
+  __m256i peak = zero;
+  __m256i sum_squares = zero;
+  __m256i clipped = zero;
+  __m256i at_or_above = zero;
+
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(samples + i));
+    peak = _mm256_max_epi16(peak, _mm256_abs_epi16(_mm256_max_epi16(x, _mm256_set1_epi16(-32767))));
+    const __m256i squares = _mm256_madd_epi16(x, x);
+    sum_squares = _mm256_add_epi64(sum_squares, _mm256_unpacklo_epi32(squares, zero));
+    sum_squares = _mm256_add_epi64(sum_squares, _mm256_unpackhi_epi32(squares, zero));
+    clipped = _mm256_sub_epi16(clipped, _mm256_or_si256(_mm256_cmpeq_epi16(x, max_value),
+                                                        _mm256_cmpeq_epi16(x, min_value)));
+    at_or_above = _mm256_sub_epi16(at_or_above,
+      _mm256_cmpeq_epi16(_mm256_max_epu16(x, threshold_value), x));
+  }
+
+  alignas(32) int16_t peak_lanes[16];
+  alignas(32) uint64_t sum_lanes[4];
+  alignas(32) uint16_t clipped_lanes[16];
+  alignas(32) uint16_t at_or_above_lanes[16];
+  _mm256_store_si256(reinterpret_cast<__m256i*>(peak_lanes), peak);
+  _mm256_store_si256(reinterpret_cast<__m256i*>(sum_lanes), sum_squares);
+  _mm256_store_si256(reinterpret_cast<__m256i*>(clipped_lanes), clipped);
+  _mm256_store_si256(reinterpret_cast<__m256i*>(at_or_above_lanes), at_or_above);
+  for (int lane = 0; lane < 16; ++lane) {
+    result->peak = std::max<int>(result->peak, peak_lanes[lane]);
+    result->clipped += clipped_lanes[lane];
+    result->at_or_above += at_or_above_lanes[lane];
+  }
+  result->sum_squares += sum_lanes[0] + sum_lanes[1] + sum_lanes[2] + sum_lanes[3];
+
+  AnalyseSamplesScalar(samples + i, count - i, threshold, result);
+}
+#endif
+#endif
+
+// Picks the widest implementation the CPU supports, once.
+static AnalyseSamplesFunction SelectAnalyseSamples() {
+#if defined(FAKE_AUDIO_AVX2)
+#if defined(__GNUC__) || defined(__clang__)
+  if (__builtin_cpu_supports("avx2")) {
+    return AnalyseSamplesAvx2;
+  }
+#else
+  return AnalyseSamplesAvx2;
+#endif
+#endif
+#if defined(FAKE_AUDIO_X86)
+  return AnalyseSamplesSse2;
+#else
+  return AnalyseSamplesScalar;
+#endif
+}
+
+static void AnalyseSamples(const int16_t* samples,
+                           size_t count,
+                           uint16_t threshold,
+                           SampleAnalysis* result) {
+  static const AnalyseSamplesFunction analyse = SelectAnalyseSamples();
+  analyse(samples, count, threshold, result);
+}
+
+static std::atomic<uint64_t> loopback_frames{0};
+static std::atomic<uint64_t> loopback_underruns{0};
+static std::atomic<uint64_t> loopback_overruns{0};
+static std::atomic<uint64_t> loopback_delay_time_us{0};
+
+static int64_t SteadyTimeMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// A single thread that pushes and pulls a frame for every playing or recording
+// FakeAudioCaptureModule each kTimePerFrameMs. Deadlines are computed from the
+// start of the schedule rather than from the previous wake up so the frame rate
+// doesn't drift, and one thread serves all the instances instead of a thread
+// (or timer) each.
+class FakeAudioClock {
+public:
+  static FakeAudioClock& Instance() {
+    static FakeAudioClock clock;
+    return clock;
+  }
+
+  void Add(FakeAudioCaptureModule* module) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    modules_.push_back(module);
+    if (!thread_.joinable()) {
+      thread_ = std::thread([this]() { Run(); });
+    }
+    wake_.notify_one();
+  }
+
+  // Blocks until a tick in progress has finished so the module is not used
+  // after this returns.
+  void Remove(FakeAudioCaptureModule* module) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    modules_.erase(std::remove(modules_.begin(), modules_.end(), module),
+      modules_.end());
+  }
+
+  FakeAudioCaptureModule::ClockStats GetStats() {
+    FakeAudioCaptureModule::ClockStats stats;
+    stats.modules = module_count_.load(std::memory_order_relaxed);
+    stats.ticks = ticks_.load(std::memory_order_relaxed);
+    stats.late_ticks = late_ticks_.load(std::memory_order_relaxed);
+    stats.busy_time_us = busy_time_us_.load(std::memory_order_relaxed);
+    return stats;
+  }
+
+private:
+  ~FakeAudioClock() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+      wake_.notify_one();
+    }
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+
+  void Run() {
+    using namespace std::chrono;
+    const auto frame = milliseconds(kTimePerFrameMs);
+    rtc::SetCurrentThreadName("fake_audio_clock");
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_) {
+      // Sleep until there's something to do, then start a new schedule.
+      wake_.wait(lock, [this]() { return stopping_ || !modules_.empty(); });
+      auto next_frame_time = steady_clock::now();
+
+      while (!stopping_ && !modules_.empty()) {
+        lock.unlock();
+        std::this_thread::sleep_until(next_frame_time);
+        lock.lock();
+
+        const auto start = steady_clock::now();
+        if (start - next_frame_time >= frame) {
+          late_ticks_.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        for (FakeAudioCaptureModule* module : modules_) {
+          module->ProcessFrameP();
+        }
+
+        const auto end = steady_clock::now();
+        module_count_.store(modules_.size(), std::memory_order_relaxed);
+        ticks_.fetch_add(1, std::memory_order_relaxed);
+        busy_time_us_.fetch_add(
+          duration_cast<microseconds>(end - start).count(),
+          std::memory_order_relaxed);
+
+        next_frame_time += frame;
+        if (end - next_frame_time > kMaxLateFrames * frame) {
+          next_frame_time = end;
+        }
+      }
+      module_count_.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::vector<FakeAudioCaptureModule*> modules_;
+  std::thread thread_;
+  bool stopping_ = false;
+
+  std::atomic<size_t> module_count_{0};
+  std::atomic<uint64_t> ticks_{0};
+  std::atomic<uint64_t> late_ticks_{0};
+  std::atomic<uint64_t> busy_time_us_{0};
+};
+
+FakeAudioCaptureModule::FakeAudioCaptureModule(const Options& options)
   : audio_callback_(nullptr),
   recording_(false),
   playing_(false),
@@ -60,27 +343,62 @@ FakeAudioCaptureModule::FakeAudioCaptureModule()
   rec_is_initialized_(false),
   current_mic_level_(kMaxVolume),
   started_(false),
-  next_frame_time_(0),
+  sample_rate_(options.sample_rate),
+  channels_(options.channels),
+  loopback_(options.loopback),
+  loopback_head_(0),
+  loopback_tail_(0),
   frames_received_(0) {
 }
 
 FakeAudioCaptureModule::~FakeAudioCaptureModule() {
+  UpdateProcessing(false);
   std::cout << "~FakeAudioCaptureModule" << std::endl;
 }
 
-rtc::scoped_refptr<FakeAudioCaptureModule> FakeAudioCaptureModule::Create() {
+rtc::scoped_refptr<FakeAudioCaptureModule> FakeAudioCaptureModule::Create(
+  const Options& options) {
+  if (!IsSupported(options)) {
+    return nullptr;
+  }
   std::cout << "FakeAudioCaptureModule" << std::endl;
-  auto capture_module = rtc::make_ref_counted<FakeAudioCaptureModule>();
+  auto capture_module = rtc::make_ref_counted<FakeAudioCaptureModule>(options);
   if (!capture_module->Initialize()) {
     return nullptr;
   }
   return capture_module;
 }
 
+bool FakeAudioCaptureModule::IsSupported(const Options& options) {
+  return options.sample_rate >= kMinSampleRate &&
+    options.sample_rate <= kMaxSampleRate && options.sample_rate % 100 == 0 &&
+    options.channels >= 1 && options.channels <= kMaxChannels;
+}
+
+FakeAudioCaptureModule::ClockStats FakeAudioCaptureModule::GetClockStats() {
+  return FakeAudioClock::Instance().GetStats();
+}
+
+FakeAudioCaptureModule::LoopbackStats FakeAudioCaptureModule::GetLoopbackStats() {
+  LoopbackStats stats;
+  stats.frames = loopback_frames.load(std::memory_order_relaxed);
+  stats.underruns = loopback_underruns.load(std::memory_order_relaxed);
+  stats.overruns = loopback_overruns.load(std::memory_order_relaxed);
+  stats.delay_time_us = loopback_delay_time_us.load(std::memory_order_relaxed);
+  return stats;
+}
+
 int FakeAudioCaptureModule::frames_received() const {
+  webrtc::MutexLock lock(&mutex_);
   return frames_received_;
 }
 
+FakeAudioCaptureModule::PlayoutStats FakeAudioCaptureModule::GetPlayoutStats()
+  const {
+  webrtc::MutexLock lock(&mutex_);
+  return playout_stats_;
+}
+
 int32_t FakeAudioCaptureModule::ActiveAudioLayer(
   AudioLayer* /*audio_layer*/) const {
   RTC_DCHECK_NOTREACHED();
@@ -89,6 +407,7 @@ int32_t FakeAudioCaptureModule::ActiveAudioLayer(
 
 int32_t FakeAudioCaptureModule::RegisterAudioCallback(
   webrtc::AudioTransport* audio_callback) {
+  webrtc::MutexLock lock(&mutex_);
   audio_callback_ = audio_callback;
   return 0;
 }
@@ -192,6 +511,7 @@ int32_t FakeAudioCaptureModule::StartPlayout() {
     return -1;
   }
   {
+    webrtc::MutexLock lock(&mutex_);
     playing_ = true;
   }
   bool start = true;
@@ -202,6 +522,7 @@ int32_t FakeAudioCaptureModule::StartPlayout() {
 int32_t FakeAudioCaptureModule::StopPlayout() {
   bool start = false;
   {
+    webrtc::MutexLock lock(&mutex_);
     playing_ = false;
     start = ShouldStartProcessing();
   }
@@ -210,6 +531,7 @@ int32_t FakeAudioCaptureModule::StopPlayout() {
 }
 
 bool FakeAudioCaptureModule::Playing() const {
+  webrtc::MutexLock lock(&mutex_);
   return playing_;
 }
 
@@ -218,6 +540,7 @@ int32_t FakeAudioCaptureModule::StartRecording() {
     return -1;
   }
   {
+    webrtc::MutexLock lock(&mutex_);
     recording_ = true;
   }
   bool start = true;
@@ -228,6 +551,7 @@ int32_t FakeAudioCaptureModule::StartRecording() {
 int32_t FakeAudioCaptureModule::StopRecording() {
   bool start = false;
   {
+    webrtc::MutexLock lock(&mutex_);
     recording_ = false;
     start = ShouldStartProcessing();
   }
@@ -236,6 +560,7 @@ int32_t FakeAudioCaptureModule::StopRecording() {
 }
 
 bool FakeAudioCaptureModule::Recording() const {
+  webrtc::MutexLock lock(&mutex_);
   return recording_;
 }
 
@@ -285,11 +610,13 @@ int32_t FakeAudioCaptureModule::MicrophoneVolumeIsAvailable(
 }
 
 int32_t FakeAudioCaptureModule::SetMicrophoneVolume(uint32_t volume) {
+  webrtc::MutexLock lock(&mutex_);
   current_mic_level_ = volume;
   return 0;
 }
 
 int32_t FakeAudioCaptureModule::MicrophoneVolume(uint32_t* volume) const {
+  webrtc::MutexLock lock(&mutex_);
   *volume = current_mic_level_;
   return 0;
 }
@@ -329,39 +656,35 @@ int32_t FakeAudioCaptureModule::MicrophoneMute(bool* /*enabled*/) const {
   return 0;
 }
 
+// Playout and recording use the same, fixed, channel count so the voice
+// engine is told stereo is only available when that's what was configured.
 int32_t FakeAudioCaptureModule::StereoPlayoutIsAvailable(
   bool* available) const {
-  // No recording device, just dropping audio. Stereo can be dropped just
-  // as easily as mono.
-  *available = true;
+  *available = channels_ == 2;
   return 0;
 }
 
-int32_t FakeAudioCaptureModule::SetStereoPlayout(bool /*enable*/) {
-  // No recording device, just dropping audio. Stereo can be dropped just
-  // as easily as mono.
-  return 0;
+int32_t FakeAudioCaptureModule::SetStereoPlayout(bool enable) {
+  return enable == (channels_ == 2) ? 0 : -1;
 }
 
-int32_t FakeAudioCaptureModule::StereoPlayout(bool* /*enabled*/) const {
+int32_t FakeAudioCaptureModule::StereoPlayout(bool* enabled) const {
+  *enabled = channels_ == 2;
   return 0;
 }
 
 int32_t FakeAudioCaptureModule::StereoRecordingIsAvailable(
   bool* available) const {
-  // Keep thing simple. No stereo recording.
-  *available = false;
+  *available = channels_ == 2;
   return 0;
 }
 
 int32_t FakeAudioCaptureModule::SetStereoRecording(bool enable) {
-  if (!enable) {
-    return 0;
-  }
-  return -1;
+  return enable == (channels_ == 2) ? 0 : -1;
 }
 
-int32_t FakeAudioCaptureModule::StereoRecording(bool* /*enabled*/) const {
+int32_t FakeAudioCaptureModule::StereoRecording(bool* enabled) const {
+  *enabled = channels_ == 2;
   return 0;
 }
 
@@ -381,27 +704,29 @@ bool FakeAudioCaptureModule::Initialize() {
 }
 
 void FakeAudioCaptureModule::SetSendBuffer(int value) {
-  Sample* buffer_ptr = reinterpret_cast<Sample*>(send_buffer_);
-  const size_t buffer_size_in_samples =
-    sizeof(send_buffer_) / kNumberBytesPerSample;
-  for (size_t i = 0; i < buffer_size_in_samples; ++i) {
-    buffer_ptr[i] = value;
-  }
+  // A constant fill is vectorised by the compiler.
+  std::fill_n(reinterpret_cast<Sample*>(send_buffer_),
+    sizeof(send_buffer_) / kNumberBytesPerSample, static_cast<Sample>(value));
 }
 
 void FakeAudioCaptureModule::ResetRecBuffer() {
-  memset(rec_buffer_, 0, sizeof(rec_buffer_));
+  memset(rec_buffer_, 0, FrameBytes());
 }
 
 bool FakeAudioCaptureModule::CheckRecBuffer(int value) {
-  const Sample* buffer_ptr = reinterpret_cast<const Sample*>(rec_buffer_);
-  const size_t buffer_size_in_samples =
-    sizeof(rec_buffer_) / kNumberBytesPerSample;
-  for (size_t i = 0; i < buffer_size_in_samples; ++i) {
-    if (buffer_ptr[i] >= value)
-      return true;
-  }
-  return false;
+  const size_t buffer_size_in_samples = FrameSamples();
+  SampleAnalysis analysis;
+  AnalyseSamples(reinterpret_cast<const int16_t*>(rec_buffer_),
+    buffer_size_in_samples, static_cast<uint16_t>(value), &analysis);
+
+  playout_stats_.frames++;
+  playout_stats_.samples += buffer_size_in_samples;
+  playout_stats_.clipped_samples += analysis.clipped;
+  playout_stats_.energy +=
+    static_cast<double>(analysis.sum_squares) / (32768.0 * 32768.0);
+  playout_stats_.last_peak = analysis.peak;
+
+  return analysis.at_or_above > 0;
 }
 
 bool FakeAudioCaptureModule::ShouldStartProcessing() {
@@ -409,24 +734,20 @@ bool FakeAudioCaptureModule::ShouldStartProcessing() {
 }
 
 void FakeAudioCaptureModule::UpdateProcessing(bool start) {
-  if (!start) {
-    started_ = false;
+  // started_ is only used from the worker thread and the destructor. mutex_
+  // must not be held here since the clock thread takes it inside its own lock.
+  if (start && !started_) {
+    started_ = true;
+    FakeAudioClock::Instance().Add(this);
   }
-}
-
-void FakeAudioCaptureModule::StartProcessP() {
-  if (started_) {
-    // Already started.
-    return;
+  else if (!start && started_) {
+    FakeAudioClock::Instance().Remove(this);
+    started_ = false;
   }
-  ProcessFrameP();
 }
 
 void FakeAudioCaptureModule::ProcessFrameP() {
-  if (!started_) {
-    next_frame_time_ = rtc::TimeMillis();
-    started_ = true;
-  }
+  webrtc::MutexLock lock(&mutex_);
 
   // Receive and send frames every kTimePerFrameMs.
   if (playing_) {
@@ -435,12 +756,6 @@ void FakeAudioCaptureModule::ProcessFrameP() {
   if (recording_) {
     SendFrameP();
   }
-
-  next_frame_time_ += kTimePerFrameMs;
-  const int64_t current_time = rtc::TimeMillis();
-  const int64_t wait_time =
-    (next_frame_time_ > current_time) ? next_frame_time_ - current_time : 0;
-    TimeDelta::Millis(wait_time);
 }
 
 void FakeAudioCaptureModule::ReceiveFrameP() {
@@ -451,8 +766,8 @@ void FakeAudioCaptureModule::ReceiveFrameP() {
   size_t nSamplesOut = 0;
   int64_t elapsed_time_ms = 0;
   int64_t ntp_time_ms = 0;
-  if (audio_callback_->NeedMorePlayData(kNumberSamples, kNumberBytesPerSample,
-    kNumberOfChannels, kSamplesPerSecond,
+  if (audio_callback_->NeedMorePlayData(FrameSamplesPerChannel(),
+    kNumberBytesPerSample * channels_, channels_, sample_rate_,
     rec_buffer_, nSamplesOut,
     &elapsed_time_ms, &ntp_time_ms) != 0) {
   }
@@ -465,6 +780,11 @@ void FakeAudioCaptureModule::ReceiveFrameP() {
   // pulled).
   if (CheckRecBuffer(kHighSampleValue)) {
     ++frames_received_;
+    playout_stats_.tone_frames++;
+  }
+
+  if (loopback_ && !PushLoopbackFrame(rec_buffer_)) {
+    loopback_overruns.fetch_add(1, std::memory_order_relaxed);
   }
 }
 
@@ -472,12 +792,48 @@ void FakeAudioCaptureModule::SendFrameP() {
   if (!audio_callback_) {
     return;
   }
+  if (loopback_) {
+    int64_t delay_us = 0;
+    if (PopLoopbackFrame(send_buffer_, &delay_us)) {
+      loopback_frames.fetch_add(1, std::memory_order_relaxed);
+      loopback_delay_time_us.fetch_add(delay_us, std::memory_order_relaxed);
+    }
+    else {
+      // Nothing has been played out yet, or playout has stalled.
+      memset(send_buffer_, 0, FrameBytes());
+      loopback_underruns.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
   bool key_pressed = false;
   uint32_t current_mic_level = current_mic_level_;
   if (audio_callback_->RecordedDataIsAvailable(
-    send_buffer_, kNumberSamples, kNumberBytesPerSample,
-    kNumberOfChannels, kSamplesPerSecond, kTotalDelayMs, kClockDriftMs,
+    send_buffer_, FrameSamplesPerChannel(), kNumberBytesPerSample * channels_,
+    channels_, sample_rate_, kTotalDelayMs, kClockDriftMs,
     current_mic_level, key_pressed, current_mic_level) != 0) {
   }
   current_mic_level_ = current_mic_level;
 }
+
+bool FakeAudioCaptureModule::PushLoopbackFrame(const char* data) {
+  const size_t head = loopback_head_.load(std::memory_order_relaxed);
+  if (head - loopback_tail_.load(std::memory_order_acquire) == kLoopbackFrames) {
+    return false;
+  }
+  LoopbackFrame& frame = loopback_ring_[head & (kLoopbackFrames - 1)];
+  frame.pulled_time_us = SteadyTimeMicros();
+  memcpy(frame.data, data, FrameBytes());
+  loopback_head_.store(head + 1, std::memory_order_release);
+  return true;
+}
+
+bool FakeAudioCaptureModule::PopLoopbackFrame(char* data, int64_t* delay_us) {
+  const size_t tail = loopback_tail_.load(std::memory_order_relaxed);
+  if (tail == loopback_head_.load(std::memory_order_acquire)) {
+    return false;
+  }
+  const LoopbackFrame& frame = loopback_ring_[tail & (kLoopbackFrames - 1)];
+  memcpy(data, frame.data, FrameBytes());
+  *delay_us = SteadyTimeMicros() - frame.pulled_time_us;
+  loopback_tail_.store(tail + 1, std::memory_order_release);
+  return true;
+}
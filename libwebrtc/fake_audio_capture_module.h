@@ -32,29 +32,86 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <array>
+#include <atomic>
 #include <memory>
 
 #include "api/audio/audio_device.h"
 #include "api/audio/audio_device_defines.h"
 #include "api/scoped_refptr.h"
+#include "rtc_base/synchronization/mutex.h"
 
 class FakeAudioCaptureModule : public webrtc::AudioDeviceModule {
 public:
   typedef uint16_t Sample;
 
-  // The value for the following constants have been derived by running VoE
-  // using a real ADM. The constants correspond to 10ms of mono audio at 44kHz.
-  static const size_t kNumberSamples = 440;
+  // The default format was derived by running VoE using a real ADM and is 10ms
+  // of mono audio at 44kHz. Matching the format to the negotiated codec, e.g.
+  // 48kHz stereo for Opus, saves resampling every frame.
+  static const int kDefaultSampleRate = 44000;
+  static const size_t kDefaultChannels = 1;
+  static const int kMinSampleRate = 8000;
+  static const int kMaxSampleRate = 48000;
+  static const size_t kMaxChannels = 2;
   static const size_t kNumberBytesPerSample = sizeof(Sample);
-
-  // Creates a FakeAudioCaptureModule or returns NULL on failure.
-  static rtc::scoped_refptr<FakeAudioCaptureModule> Create();
+  // Samples, over all channels, in the largest 10ms frame.
+  static const size_t kMaxNumberSamples = kMaxSampleRate / 100 * kMaxChannels;
+
+  struct Options {
+    // Send the frames pulled for playout back as the recorded audio instead
+    // of a constant buffer.
+    bool loopback = false;
+    // Must be a multiple of 100 so a frame is a whole number of samples.
+    int sample_rate = kDefaultSampleRate;
+    size_t channels = kDefaultChannels;
+  };
+
+  // Counters for the clock thread that pushes and pulls the frames of every
+  // instance.
+  struct ClockStats {
+    size_t modules = 0;           // Instances currently playing or recording.
+    uint64_t ticks = 0;           // 10ms ticks processed.
+    uint64_t late_ticks = 0;      // Ticks that started a frame or more late.
+    uint64_t busy_time_us = 0;    // Time spent processing frames.
+  };
+
+  // Counters for loopback mode, summed over all instances.
+  struct LoopbackStats {
+    uint64_t frames = 0;          // Playout frames sent back.
+    uint64_t underruns = 0;       // Recorded frames with no playout frame to send.
+    uint64_t overruns = 0;        // Playout frames dropped because the ring was full.
+    uint64_t delay_time_us = 0;   // Total time frames spent in the ring.
+  };
+
+  // Measurements of the frames pulled for playout by an instance.
+  struct PlayoutStats {
+    uint64_t frames = 0;
+    uint64_t tone_frames = 0;      // Frames containing the sent tone, see frames_received().
+    uint64_t samples = 0;
+    uint64_t clipped_samples = 0;  // Samples at positive or negative full scale.
+    double energy = 0;             // Sum of the squared samples, full scale is 1.
+    int last_peak = 0;             // Largest absolute sample of the last frame.
+  };
+
+  // Creates a FakeAudioCaptureModule or returns NULL on failure, including
+  // when the options are not a supported format.
+  static rtc::scoped_refptr<FakeAudioCaptureModule> Create(
+    const Options& options = Options());
+
+  static bool IsSupported(const Options& options);
+
+  static ClockStats GetClockStats();
+  static LoopbackStats GetLoopbackStats();
 
   // Returns the number of frames that have been successfully pulled by the
   // instance. Note that correctly detecting success can only be done if the
   // pulled frame was generated/pushed from a FakeAudioCaptureModule.
   int frames_received() const;
 
+  // Returns a snapshot of the playout measurements. The RMS level over an
+  // interval is sqrt(energy / samples) of the difference of two snapshots.
+  PlayoutStats GetPlayoutStats() const;
+
   int32_t ActiveAudioLayer(AudioLayer* audio_layer) const override;
 
   // Note: Calling this method from a callback may result in deadlock.
@@ -148,7 +205,7 @@ protected:
   // exposed in which case the burden of proper instantiation would be put on
   // the creator of a FakeAudioCaptureModule instance. To create an instance of
   // this class use the Create(..) API.
-  FakeAudioCaptureModule();
+  explicit FakeAudioCaptureModule(const Options& options);
   // The destructor is protected because it is reference counted and should not
   // be deleted directly.
   virtual ~FakeAudioCaptureModule();
@@ -157,10 +214,16 @@ private:
   // Initializes the state of the FakeAudioCaptureModule. This API is called on
   // creation by the Create() API.
   bool Initialize();
+  // Samples per channel in a 10ms frame.
+  size_t FrameSamplesPerChannel() const { return sample_rate_ / 100; }
+  // Samples over all channels in a 10ms frame.
+  size_t FrameSamples() const { return FrameSamplesPerChannel() * channels_; }
+  size_t FrameBytes() const { return FrameSamples() * kNumberBytesPerSample; }
   // SetBuffer() sets all samples in send_buffer_ to `value`.
   void SetSendBuffer(int value);
   // Resets rec_buffer_. I.e., sets all rec_buffer_ samples to 0.
   void ResetRecBuffer();
+  // Adds the peak, energy and clipping of rec_buffer_ to playout_stats_.
   // Returns true if rec_buffer_ contains one or more sample greater than or
   // equal to `value`.
   bool CheckRecBuffer(int value);
@@ -172,16 +235,20 @@ private:
   // Starts or stops the pushing and pulling of audio frames.
   void UpdateProcessing(bool start);
 
-  // Starts the periodic calling of ProcessFrame() in a thread safe way.
-  void StartProcessP();
-  // Periodcally called function that ensures that frames are pulled and pushed
-  // periodically if enabled/started.
+  // Called by the shared clock thread every kTimePerFrameMs while processing.
+  // Pulls and pushes a frame if enabled/started.
   void ProcessFrameP();
   // Pulls frames from the registered webrtc::AudioTransport.
   void ReceiveFrameP();
   // Pushes frames to the registered webrtc::AudioTransport.
   void SendFrameP();
 
+  // Loopback ring of playout frames. ReceiveFrameP is the only producer and
+  // SendFrameP the only consumer, so the head and tail are the only
+  // synchronisation needed.
+  bool PushLoopbackFrame(const char* data);
+  bool PopLoopbackFrame(char* data, int64_t* delay_us);
+
   // Callback for playout and recording.
   webrtc::AudioTransport* audio_callback_;
 
@@ -196,27 +263,43 @@ private:
   // mic level so it just feeds back what it receives.
   uint32_t current_mic_level_;
 
-  // next_frame_time_ is updated in a non-drifting manner to indicate the next
-  // wall clock time the next frame should be generated and received. started_
-  // ensures that next_frame_time_ can be initialized properly on first call.
+  // True while the instance is registered with the clock thread.
   bool started_;
-  int64_t next_frame_time_;
 
-  // Buffer for storing samples received from the webrtc::AudioTransport.
-  char rec_buffer_[kNumberSamples * kNumberBytesPerSample];
+  const int sample_rate_;
+  const size_t channels_;
+
+  // Buffer for storing samples received from the webrtc::AudioTransport. Sized
+  // for the largest format, only the first FrameBytes() are used.
+  char rec_buffer_[kMaxNumberSamples * kNumberBytesPerSample];
   // Buffer for samples to send to the webrtc::AudioTransport.
-  char send_buffer_[kNumberSamples * kNumberBytesPerSample];
+  char send_buffer_[kMaxNumberSamples * kNumberBytesPerSample];
+
+  // Number of frames the loopback ring holds, must be a power of two.
+  static const size_t kLoopbackFrames = 16;
+
+  struct LoopbackFrame {
+    int64_t pulled_time_us;
+    char data[kMaxNumberSamples * kNumberBytesPerSample];
+  };
+
+  const bool loopback_;
+  std::array<LoopbackFrame, kLoopbackFrames> loopback_ring_;
+  std::atomic<size_t> loopback_head_;  // Next frame to write, producer only.
+  std::atomic<size_t> loopback_tail_;  // Next frame to read, consumer only.
 
   // Counter of frames received that have samples of high enough amplitude to
   // indicate that the frames are not faked somewhere in the audio pipeline
   // (e.g. by a jitter buffer).
   int frames_received_;
 
-  // Protects variables that are accessed from process_thread_ and
-  // the main thread.
-  //mutable webrtc::Mutex mutex_;
-  //webrtc::SequenceChecker process_thread_checker_{
-  //  webrtc::SequenceChecker::kDetached };
+  PlayoutStats playout_stats_;
+
+  // Protects variables that are accessed from the clock thread and
+  // the worker thread.
+  mutable webrtc::Mutex mutex_;
+
+  friend class FakeAudioClock;
 };
 
 #endif  // PC_TEST_FAKE_AUDIO_CAPTURE_MODULE_H_
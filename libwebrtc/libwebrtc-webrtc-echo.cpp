@@ -18,6 +18,7 @@
 * License: Public Domain (no warranty, use at own risk)
 /******************************************************************************/
 
+#include "AsyncLogger.h"
 #include "HttpSimpleServer.h"
 #include "PcFactory.h"
 
@@ -26,20 +27,183 @@
 #include <rtc_base/logging.h>
 #include <rtc_base/thread.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
 #include <condition_variable>
 #include <iostream>
 #include <memory>
 #include <mutex>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <api/rtc_event_log/rtc_event_log_factory.h>
 
 #define HTTP_SERVER_ADDRESS "0.0.0.0"
 #define HTTP_SERVER_PORT 8080
 #define HTTP_OFFER_URL "/offer"
 
-int main()
+static void PrintUsage(const char* program)
 {
-  std::cout << "libwebrtc echo test server" << std::endl;
+  std::cout << "Usage: " << program << " [options]" << std::endl
+    << "  --max-pcs N            maximum number of live peer connections (default " << DEFAULT_MAX_PEER_CONNECTIONS << ")" << std::endl
+    << "  --shards N             number of peer connection factory shards, 0 for one per core (default 1)" << std::endl
+    << "  --shard-policy POLICY  roundrobin or leastloaded (default roundrobin)" << std::endl
+    << "  --no-audio-track-cache create a new audio source and track for every peer connection" << std::endl
+    << "  --audio-loopback       send the received audio back instead of a constant tone" << std::endl
+    << "  --audio-rate HZ        fake audio device sample rate, 8000 to 48000 (default " << FakeAudioCaptureModule::kDefaultSampleRate << ")" << std::endl
+    << "  --audio-channels N     fake audio device channels, 1 or 2 (default " << FakeAudioCaptureModule::kDefaultChannels << ")" << std::endl
+    << "  --certificates N       DTLS certificates shared by all peer connections, 0 to generate one per peer connection (default " << DEFAULT_CERTIFICATE_COUNT << ")" << std::endl
+    << "  --certificate-type T   ecdsa or rsa (default ecdsa)" << std::endl
+    << "  --certificate-rotation SECONDS  replace each shared certificate after SECONDS, at most 29 days (default " << DEFAULT_CERTIFICATE_ROTATION_SECONDS << ")" << std::endl
+    << "  --ice-ports MIN[-MAX]  local UDP port range for ICE, each peer connection binds its own port (default any)" << std::endl
+    << "  --ice-udp-only         gather host UDP candidates only, no TCP, STUN or relay" << std::endl
+    << "  --ice-default-route    gather on the default route only instead of on every network interface" << std::endl
+    << "  --reactors N           number of HTTP event loop threads sharing the port, 0 for one per core (default 1)" << std::endl
+    << "  --log-level LEVEL      debug, info, warning, error or none (default info)" << std::endl
+    << "  --log-sdp              log the SDP of every offer and answer" << std::endl;
+}
+
+/**
+* Parses a whole decimal option value within [min, max]. std::stoul on its own
+* accepts trailing characters and wraps negative values around.
+*/
+static long ParseNumber(const std::string& text, long min, long max)
+{
+  char* end = nullptr;
+  errno = 0;
+  long value = std::strtol(text.c_str(), &end, 10);
+  if (text.empty() || *end != '\0' || errno == ERANGE || value < min || value > max) {
+    throw std::invalid_argument("expected a number from " + std::to_string(min) + " to " + std::to_string(max));
+  }
+  return value;
+}
+
+int main(int argc, char* argv[])
+{
+  size_t maxPeerConnections = DEFAULT_MAX_PEER_CONNECTIONS;
+  size_t shardCount = 1;
+  PcShardPolicy shardPolicy = PcShardPolicy::RoundRobin;
+  int reactorCount = 1;
+  bool cacheAudioTrack = true;
+  FakeAudioCaptureModule::Options audioOptions;
+  size_t certificateCount = DEFAULT_CERTIFICATE_COUNT;
+  PcCertificateType certificateType = PcCertificateType::Ecdsa;
+  int certificateRotation = DEFAULT_CERTIFICATE_ROTATION_SECONDS;
+  PcIceOptions iceOptions;
+  LogLevel logLevel = LogLevel::Info;
+  bool logSdp = false;
+
+  std::string arg;
+  try {
+    for (int i = 1; i < argc; i++) {
+      arg = argv[i];
+      if (arg == "--max-pcs" && i + 1 < argc) {
+        maxPeerConnections = ParseNumber(argv[++i], 1, 1000000);
+      }
+      else if (arg == "--shards" && i + 1 < argc) {
+        shardCount = ParseNumber(argv[++i], 0, 1024);
+        if (shardCount == 0) {
+          shardCount = std::max(1u, std::thread::hardware_concurrency());
+        }
+      }
+      else if (arg == "--shard-policy" && i + 1 < argc) {
+        std::string policy = argv[++i];
+        if (policy == "roundrobin") {
+          shardPolicy = PcShardPolicy::RoundRobin;
+        }
+        else if (policy == "leastloaded") {
+          shardPolicy = PcShardPolicy::LeastLoaded;
+        }
+        else {
+          PrintUsage(argv[0]);
+          return -1;
+        }
+      }
+      else if (arg == "--reactors" && i + 1 < argc) {
+        reactorCount = ParseNumber(argv[++i], 0, 1024);
+        if (reactorCount == 0) {
+          reactorCount = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+        }
+      }
+      else if (arg == "--log-level" && i + 1 < argc) {
+        if (!AsyncLogger::ParseLevel(argv[++i], logLevel)) {
+          PrintUsage(argv[0]);
+          return -1;
+        }
+      }
+      else if (arg == "--no-audio-track-cache") {
+        cacheAudioTrack = false;
+      }
+      else if (arg == "--audio-loopback") {
+        audioOptions.loopback = true;
+      }
+      else if (arg == "--audio-rate" && i + 1 < argc) {
+        audioOptions.sample_rate = ParseNumber(argv[++i], 8000, 48000);
+      }
+      else if (arg == "--audio-channels" && i + 1 < argc) {
+        audioOptions.channels = ParseNumber(argv[++i], 1, 2);
+      }
+      else if (arg == "--certificates" && i + 1 < argc) {
+        certificateCount = ParseNumber(argv[++i], 0, 1024);
+      }
+      else if (arg == "--certificate-type" && i + 1 < argc) {
+        std::string type = argv[++i];
+        if (type == "ecdsa") {
+          certificateType = PcCertificateType::Ecdsa;
+        }
+        else if (type == "rsa") {
+          certificateType = PcCertificateType::Rsa;
+        }
+        else {
+          PrintUsage(argv[0]);
+          return -1;
+        }
+      }
+      else if (arg == "--certificate-rotation" && i + 1 < argc) {
+        certificateRotation = ParseNumber(argv[++i], 1, MAX_CERTIFICATE_ROTATION_SECONDS);
+      }
+      else if (arg == "--ice-ports" && i + 1 < argc) {
+        std::string range = argv[++i];
+        size_t separator = range.find('-');
+        iceOptions.minPort = ParseNumber(range.substr(0, separator), 1, 65535);
+        iceOptions.maxPort = separator != std::string::npos ? ParseNumber(range.substr(separator + 1), iceOptions.minPort, 65535) : iceOptions.minPort;
+      }
+      else if (arg == "--ice-udp-only") {
+        iceOptions.udpOnly = true;
+      }
+      else if (arg == "--ice-default-route") {
+        iceOptions.defaultRouteOnly = true;
+      }
+      else if (arg == "--log-sdp") {
+        logSdp = true;
+      }
+      else {
+        PrintUsage(argv[0]);
+        return arg == "--help" ? 0 : -1;
+      }
+    }
+  }
+  catch (const std::exception& excp) {
+    std::cerr << "Invalid value for " << arg << ", " << excp.what() << "." << std::endl;
+    PrintUsage(argv[0]);
+    return -1;
+  }
+
+  if (!FakeAudioCaptureModule::IsSupported(audioOptions)) {
+    PrintUsage(argv[0]);
+    return -1;
+  }
+
+  if (audioOptions.loopback && maxPeerConnections > shardCount) {
+    std::cerr << "--audio-loopback needs a shard per peer connection, set --max-pcs to no more than --shards." << std::endl;
+    PrintUsage(argv[0]);
+    return -1;
+  }
+
+  AsyncLogger::Instance().Start(logLevel, logSdp);
+
+  ECHO_LOG_INFO("libwebrtc echo test server");
 
 #ifdef _WIN32
   {
@@ -51,23 +215,32 @@ int main()
   }
 #endif
 
-  std::cout << "libevent version " << event_get_version() << "." << std::endl;
+  ECHO_LOG_INFO("libevent version " << event_get_version() << ".");
 
   rtc::LogMessage::LogToDebug(rtc::LoggingSeverity::LS_WARNING);
 
   {
-    std::cout << "On main thread, thread ID " << std::this_thread::get_id() << std::endl;
+    ECHO_LOG_DEBUG("On main thread, thread ID " << std::this_thread::get_id());
+
+    std::unique_ptr<PcCertificates> certificates;
+    if (certificateCount > 0) {
+      certificates = std::make_unique<PcCertificates>(certificateCount, certificateType, std::chrono::seconds(certificateRotation));
+    }
 
-    PcFactory pcFactory;
+    PcFactory pcFactory(maxPeerConnections, shardCount, shardPolicy, cacheAudioTrack, audioOptions, certificates.get(), iceOptions);
 
-    HttpSimpleServer httpSvr;
+    HttpSimpleServer httpSvr(reactorCount);
     httpSvr.Init(HTTP_SERVER_ADDRESS, HTTP_SERVER_PORT, HTTP_OFFER_URL);
     HttpSimpleServer::SetPeerConnectionFactory(&pcFactory);
 
     httpSvr.Run();
 
-    std::cout << "Stopping HTTP server..." << std::endl;
+    ECHO_LOG_INFO("Stopping HTTP server...");
 
+    /* Answers are posted to the reactors' event_bases from the signaling threads, so
+    * those have to be stopped before the event_bases are freed.
+    */
+    pcFactory.Shutdown();
     httpSvr.Stop();
   }
 
@@ -75,5 +248,6 @@ int main()
   WSACleanup();
 #endif
 
-  std::cout << "Exiting..." << std::endl;
+  ECHO_LOG_INFO("Exiting...");
+  AsyncLogger::Instance().Stop();
 }
\ No newline at end of file